@@ -0,0 +1,248 @@
+/**
+ * capture_bench - compare time range and ID queries on a capture file against a linear scan of
+ * the plain text log the device produces
+ *
+ * usage: capture_bench [--frames N] [--dir path] [--keep]
+ *
+ * Generates a synthetic hex mode log (100 periodic IDs plus a rare diagnostic ID 0x7E8 in
+ * bursts), converts it with the same parser capture_convert uses, then times the queries both
+ * ways. At 53 bytes of text per frame, --frames 50000000 gives a ~2.7 GB log. Both files are
+ * freshly written so both run from the page cache.
+ */
+#include "capture_reader.h"
+#include "capture_writer.h"
+#include "stream_parser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void put_be32(uint8_t* dst, uint32_t value) {
+    dst[0] = value >> 24; dst[1] = value >> 16; dst[2] = value >> 8; dst[3] = value;
+}
+
+/**
+ * @brief Write a synthetic hex mode log, returns the total capture duration in microseconds
+ */
+static uint64_t generate_log(const std::string& path, uint64_t frames) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if(file == nullptr)
+        throw std::runtime_error("could not create " + path);
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<uint32_t> delta(50, 250);
+    std::uniform_int_distribution<uint32_t> periodic_id(0x100, 0x163);
+    std::uniform_int_distribution<uint32_t> byte(0, 255);
+
+    uint64_t time_us = 0;
+    // Capture channel message: channel (1), length (4), record (10 + 8), crc16 (2)
+    uint8_t message[1 + 4 + 10 + 8 + 2];
+    char line[sizeof(message) * 2 + 3];
+    std::string out;
+    out.reserve(1 << 20);
+
+    for(uint64_t i = 0; i < frames; i++) {
+        uint32_t frame_delta = delta(rng);
+        // A burst of 16 diagnostic frames every 500000 frames
+        uint32_t id = (i % 500000) < 16 ? 0x7E8 : periodic_id(rng);
+
+        message[0] = static_cast<uint8_t>(canshark::channel::capture);
+        put_be32(message + 1, 10 + 8);
+        put_be32(message + 5, frame_delta);
+        message[9] = 0; message[10] = 0;
+        put_be32(message + 11, id);
+        for(int b = 0; b < 8; b++)
+            message[15 + b] = static_cast<uint8_t>(byte(rng));
+
+        uint16_t crc = canshark::crc16_update(canshark::crc16_update(0xffff, message, 1), message + 5, 10 + 8) ^ 0xffff;
+        message[23] = crc >> 8; message[24] = crc & 0xff;
+
+        size_t len = 0;
+        line[len++] = '<';
+        for(uint8_t value : message) {
+            line[len++] = hex_digits[value >> 4];
+            line[len++] = hex_digits[value & 0x0f];
+        }
+        line[len++] = '>';
+        line[len++] = '\n';
+
+        out.append(line, len);
+        if(out.size() > (1 << 20) - sizeof(line)) {
+            std::fwrite(out.data(), 1, out.size(), file);
+            out.clear();
+        }
+
+        time_us += frame_delta;
+    }
+
+    std::fwrite(out.data(), 1, out.size(), file);
+    std::fclose(file);
+
+    return time_us;
+}
+
+static uint32_t parse_hex32(const char* text) {
+    uint32_t value = 0;
+
+    for(int i = 0; i < 8; i++) {
+        char c = text[i];
+        value = (value << 4) | static_cast<uint32_t>(c <= '9' ? c - '0' : c - 'A' + 10);
+    }
+
+    return value;
+}
+
+/**
+ * @brief Linear scan of the text log, what grepping / scripting over the log amounts to. Times
+ * are deltas so a time query has to walk every line from the start.
+ */
+static uint64_t text_scan(const std::string& path, uint64_t from_us, uint64_t to_us, bool match_id, uint32_t id) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    ::fstat(fd, &st);
+
+    const char* text = static_cast<const char*>(::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0));
+    const char* end = text + st.st_size;
+    uint64_t time_us = 0;
+    uint64_t matches = 0;
+
+    ::madvise(const_cast<char*>(text), st.st_size, MADV_SEQUENTIAL);
+
+    for(const char* line = text; line < end; ) {
+        const char* next = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        next = next == nullptr ? end : next + 1;
+
+        // <CC LLLLLLLL TTTTTTTT YYYY IIIIIIII ...
+        if(line[0] == '<' && next - line > 1 + 30) {
+            time_us += parse_hex32(line + 1 + 10);
+
+            if(time_us >= from_us && time_us <= to_us && (!match_id || parse_hex32(line + 1 + 22) == id))
+                matches++;
+        }
+
+        line = next;
+    }
+
+    ::munmap(const_cast<char*>(text), st.st_size);
+    ::close(fd);
+
+    return matches;
+}
+
+int main(int argc, char** argv) {
+    uint64_t frames = 10000000;
+    std::string dir = ".";
+    bool keep = false;
+
+    for(int i = 1; i < argc; i++) {
+        if(std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = std::strtoull(argv[++i], nullptr, 0);
+        else if(std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else if(std::strcmp(argv[i], "--keep") == 0)
+            keep = true;
+        else {
+            std::fprintf(stderr, "usage: %s [--frames N] [--dir path] [--keep]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::string log_path = dir + "/capture_bench.log";
+    std::string capture_path = dir + "/capture_bench.cshk";
+
+    try {
+        auto start = bench_clock::now();
+        uint64_t duration_us = generate_log(log_path, frames);
+        std::printf("generate   %llu frames, %.1f s of traffic in %.2f s\n",
+            static_cast<unsigned long long>(frames), duration_us / 1e6, seconds_since(start));
+
+        start = bench_clock::now();
+        {
+            canshark::capture_writer writer(capture_path);
+            canshark::stream_parser parser([&](const canshark::capture_record& record) {
+                writer.append(record);
+            });
+
+            FILE* log = std::fopen(log_path.c_str(), "rb");
+            uint8_t buffer[1 << 16];
+            size_t len;
+
+            while((len = std::fread(buffer, 1, sizeof(buffer), log)) > 0)
+                parser.feed(buffer, len);
+
+            std::fclose(log);
+            writer.close();
+        }
+        double convert_s = seconds_since(start);
+
+        struct stat log_st, capture_st;
+        ::stat(log_path.c_str(), &log_st);
+        ::stat(capture_path.c_str(), &capture_st);
+        std::printf("convert    %.2f s, text %.1f MB -> capture %.1f MB\n", convert_s,
+            log_st.st_size / 1e6, capture_st.st_size / 1e6);
+
+        // One second window three quarters of the way in, and every frame of the rare ID
+        uint64_t from_us = duration_us * 3 / 4;
+        uint64_t to_us = from_us + 1000000;
+
+        struct query_t { const char* name; bool match_id; uint32_t id; uint64_t from; uint64_t to; };
+        const query_t queries[] = {
+            { "1 s window", false, 0, from_us, to_us },
+            { "ID 0x7E8 (rare)", true, 0x7E8, 0, UINT64_MAX },
+            { "ID 0x120 (common)", true, 0x120, 0, UINT64_MAX },
+            { "ID 0x120 in 1 s", true, 0x120, from_us, to_us },
+        };
+
+        std::printf("\n%-20s %12s %12s %10s %10s\n", "query", "text (s)", "indexed (s)", "speedup", "matches");
+
+        for(const query_t& query : queries) {
+            start = bench_clock::now();
+            uint64_t text_matches = text_scan(log_path, query.from, query.to, query.match_id, query.id);
+            double text_s = seconds_since(start);
+
+            start = bench_clock::now();
+            canshark::capture_reader reader(capture_path);
+            uint64_t indexed_matches = 0;
+            auto count = [&](const canshark::capture_record&) { indexed_matches++; };
+
+            if(query.match_id)
+                reader.for_each_with_id_in_range(query.id, query.from, query.to, count);
+            else
+                reader.for_each_in_range(query.from, query.to, count);
+            double indexed_s = seconds_since(start);
+
+            std::printf("%-20s %12.4f %12.4f %9.1fx %10llu%s\n", query.name, text_s, indexed_s,
+                text_s / indexed_s, static_cast<unsigned long long>(indexed_matches),
+                text_matches == indexed_matches ? "" : "  MISMATCH");
+
+            if(text_matches != indexed_matches)
+                return 1;
+        }
+    } catch(const std::exception& e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+
+    if(!keep) {
+        std::remove(log_path.c_str());
+        std::remove(capture_path.c_str());
+    }
+
+    return 0;
+}
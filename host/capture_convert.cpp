@@ -0,0 +1,123 @@
+/**
+ * capture_convert - write a live device stream into a capture file as it arrives
+ *
+ * usage: capture_convert <output.cshk> [input]
+ *
+ * input defaults to stdin, it can be the serial device (configure it with stty first) or a
+ * saved text log. Device log lines and control messages are printed to stderr. The partial
+ * block is flushed every second so capture_query can follow a capture that is still running,
+ * the index is written on EOF or Ctrl+C.
+ */
+#include "capture_writer.h"
+#include "stream_parser.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+static constexpr std::chrono::milliseconds flush_interval(1000);
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal(int) {
+    stop_requested = 1;
+}
+
+static uint32_t read_be32(const uint8_t* data) {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+/**
+ * @brief Print a log or control channel message, see comms_control_kind in main/comms.h
+ */
+static void print_message(canshark::channel source, const uint8_t* payload, size_t len) {
+    if(source == canshark::channel::log && len >= 4) {
+        uint32_t dropped = read_be32(payload);
+
+        if(dropped > 0)
+            std::fprintf(stderr, "[log] %u lines dropped\n", dropped);
+        std::fprintf(stderr, "[log] %.*s\n", static_cast<int>(len - 4), reinterpret_cast<const char*>(payload + 4));
+        return;
+    }
+
+    if(source != canshark::channel::control || len == 0)
+        return;
+
+    if(payload[0] == 0 && len >= 2)
+        std::fprintf(stderr, "[control] ready%s\n", payload[1] ? ", running an OTA image" : "");
+    else if(payload[0] == 1 && len >= 6)
+        std::fprintf(stderr, "[control] '%c' -> 0x%x\n", payload[1], read_be32(payload + 2));
+    else if(payload[0] == 2 && len >= 9)
+        std::fprintf(stderr, "[control] update %u of %u\n", read_be32(payload + 1), read_be32(payload + 5));
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::fprintf(stderr, "usage: %s <output.cshk> [input]\n", argv[0]);
+        return 1;
+    }
+
+    int input = STDIN_FILENO;
+
+    if(argc > 2) {
+        input = ::open(argv[2], O_RDONLY | O_NOCTTY);
+        if(input < 0) {
+            std::perror(argv[2]);
+            return 1;
+        }
+    }
+
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+
+    try {
+        canshark::capture_writer writer(argv[1]);
+        canshark::stream_parser parser([&](const canshark::capture_record& record) {
+            writer.append(record);
+        }, print_message);
+
+        uint8_t buffer[64 * 1024];
+        struct pollfd pfd = { input, POLLIN, 0 };
+        auto next_flush = std::chrono::steady_clock::now() + flush_interval;
+
+        while(!stop_requested) {
+            // Flush on the clock, a steady trickle of input would otherwise never let poll time out
+            auto now = std::chrono::steady_clock::now();
+
+            if(now >= next_flush) {
+                writer.flush();
+                next_flush = now + flush_interval;
+            }
+
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_flush - now).count();
+            int ready = ::poll(&pfd, 1, static_cast<int>(wait) + 1);
+
+            if(ready == 0)
+                continue;
+
+            if(ready < 0)
+                continue; // Interrupted, stop_requested is checked above
+
+            ssize_t len = ::read(input, buffer, sizeof(buffer));
+            if(len <= 0)
+                break;
+
+            parser.feed(buffer, static_cast<size_t>(len));
+        }
+
+        writer.close();
+
+        std::fprintf(stderr, "%llu records, %llu crc errors, %llu bytes skipped\n",
+            static_cast<unsigned long long>(writer.record_count()),
+            static_cast<unsigned long long>(parser.crc_errors()),
+            static_cast<unsigned long long>(parser.skipped_bytes()));
+    } catch(const std::exception& e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+#ifndef _CAPTURE_FORMAT_H_
+#define _CAPTURE_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CAN Shark capture file (.cshk), all integers are little endian
+ *
+ *  file_header
+ *  block_header + segment_entry table + zlib compressed segments     (repeated)
+ *  index_entry                                                       (one per block)
+ *  file_footer
+ *
+ * Blocks are written in time order, each block header carries its time range and a bitmap of the
+ * IDs it contains so a reader can skip straight to the blocks a query needs. Within a block the
+ * records are split into one segment per ID, each compressed on its own, so an ID query only
+ * decompresses that ID's segment even when the ID is in every block. A decompressed segment is
+ * segment_entry::record_count fixed size frame_records, in capture order, followed by an
+ * overflow area holding the payloads that don't fit inline. The segment table is sorted by ID.
+ *
+ * The index at the end is a copy of every block header with its file offset. If the footer is
+ * missing (live or interrupted capture) the index is rebuilt by walking the block headers.
+ */
+namespace canshark {
+
+constexpr char capture_magic[8] = { 'C', 'S', 'H', 'K', 'C', 'A', 'P', '1' };
+constexpr uint32_t capture_version = 2;
+constexpr uint32_t block_magic = 0x4B4C4243; // "CBLK"
+constexpr uint32_t footer_magic = 0x58444E49; // "INDX"
+
+constexpr size_t inline_data_len = 16;
+constexpr size_t id_bitmap_bits = 2048;
+constexpr uint32_t default_block_records = 4096;
+
+// Matches can_message_type in main/can_bus.h
+enum class record_type : uint16_t {
+    standard_frame = 0,
+    remote_frame = 1,
+    overload_event = 2,
+    drop_report = 3,
+    id_summary = 4,
+    telemetry = 5,
+    isotp_pdu = 6,
+    isotp_error = 7,
+    pid_result = 8,
+    bus_event = 9,
+    boot_timing = 10,
+    benchmark_report = 11
+};
+
+#pragma pack(push, 1)
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t block_records;
+    uint32_t reserved;
+    uint64_t created_unix_us;
+    uint64_t reserved2[4];
+};
+
+struct frame_record {
+    uint64_t timestamp_us;          // Microseconds since the start of the capture
+    uint32_t id;
+    uint16_t type;                  // record_type
+    uint16_t length;                // Payload length
+    uint8_t data[inline_data_len];  // Payload, or a uint32_t offset into the overflow area if length > inline_data_len
+};
+
+struct block_header {
+    uint32_t magic;
+    uint32_t record_count;
+    uint32_t raw_size;              // All segments decompressed
+    uint32_t compressed_size;       // Bytes following the header, segment table included
+    uint64_t first_timestamp_us;   // Earliest and latest record time in the block
+    uint64_t last_timestamp_us;
+    uint32_t segment_count;
+    uint32_t reserved;
+    uint8_t id_bitmap[id_bitmap_bits / 8];
+};
+
+struct segment_entry {
+    uint32_t id;
+    uint32_t record_count;
+    uint32_t raw_size;
+    uint32_t compressed_offset;     // From the end of the segment table
+    uint32_t compressed_size;
+};
+
+struct index_entry {
+    uint64_t offset;                // File offset of the block header
+    block_header header;
+};
+
+struct file_footer {
+    uint64_t index_offset;
+    uint64_t block_count;
+    uint64_t record_count;
+    uint32_t magic;
+    uint32_t reserved;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(file_header) == 64, "file_header must stay 64 bytes");
+static_assert(sizeof(frame_record) == 32, "frame_record must stay 32 bytes");
+static_assert(sizeof(file_footer) == 32, "file_footer must stay 32 bytes");
+static_assert(sizeof(segment_entry) == 20, "segment_entry must stay 20 bytes");
+
+/**
+ * @brief A decoded record, data points into a buffer owned by whoever produced the record and is
+ * only valid until the next record is produced
+ */
+struct capture_record {
+    uint64_t timestamp_us;
+    uint32_t id;
+    record_type type;
+    const uint8_t* data;
+    size_t length;
+};
+
+/**
+ * @brief Bit used for an ID in the block bitmap. 11 bit IDs map to their own bit, 29 bit IDs
+ * are folded so they may share a bit, readers still filter records after decompressing.
+ */
+inline size_t id_bitmap_bit(uint32_t id) {
+    return (id ^ (id >> 11) ^ (id >> 22)) % id_bitmap_bits;
+}
+
+inline bool id_bitmap_test(const uint8_t* bitmap, uint32_t id) {
+    size_t bit = id_bitmap_bit(id);
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+inline void id_bitmap_set(uint8_t* bitmap, uint32_t id) {
+    size_t bit = id_bitmap_bit(id);
+    bitmap[bit / 8] |= (1 << (bit % 8));
+}
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ * capture_query - print the records of a capture file for a time range and/or ID
+ *
+ * usage: capture_query <capture.cshk> [--from us] [--to us] [--id id]
+ *
+ * IDs may be given in hex (0x7E8). Output is one record per line: time in seconds, record
+ * type, ID and payload in hex.
+ */
+#include "capture_reader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::fprintf(stderr, "usage: %s <capture.cshk> [--from us] [--to us] [--id id]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t from_us = 0;
+    uint64_t to_us = UINT64_MAX;
+    bool have_id = false;
+    uint32_t id = 0;
+
+    for(int i = 2; i + 1 < argc; i += 2) {
+        if(std::strcmp(argv[i], "--from") == 0) {
+            from_us = std::strtoull(argv[i + 1], nullptr, 0);
+        } else if(std::strcmp(argv[i], "--to") == 0) {
+            to_us = std::strtoull(argv[i + 1], nullptr, 0);
+        } else if(std::strcmp(argv[i], "--id") == 0) {
+            id = static_cast<uint32_t>(std::strtoul(argv[i + 1], nullptr, 0));
+            have_id = true;
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    try {
+        canshark::capture_reader reader(argv[1]);
+
+        auto print = [](const canshark::capture_record& record) {
+            std::printf("%llu.%06llu %2u %08X ",
+                static_cast<unsigned long long>(record.timestamp_us / 1000000),
+                static_cast<unsigned long long>(record.timestamp_us % 1000000),
+                static_cast<unsigned>(record.type), record.id);
+
+            for(size_t i = 0; i < record.length; i++)
+                std::printf("%02X", record.data[i]);
+
+            std::printf("\n");
+        };
+
+        if(have_id)
+            reader.for_each_with_id_in_range(id, from_us, to_us, print);
+        else
+            reader.for_each_in_range(from_us, to_us, print);
+
+        if(reader.index_rebuilt())
+            std::fprintf(stderr, "note: capture has no index (still running or interrupted), rebuilt from block headers\n");
+    } catch(const std::exception& e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,307 @@
+#include "capture_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace canshark {
+
+/**
+ * @brief Map the capture file and load its index
+ *
+ * @param path
+ */
+capture_reader::capture_reader(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if(fd_ < 0)
+        throw std::runtime_error("could not open " + path);
+
+    struct stat st;
+    if(::fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(file_header)) {
+        ::close(fd_);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+
+    void* map = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if(map == MAP_FAILED) {
+        ::close(fd_);
+        throw std::runtime_error("could not map " + path);
+    }
+
+    map_ = static_cast<const uint8_t*>(map);
+
+    // Blocks are read in order by scans, the index makes seeks random
+    ::madvise(map, size_, MADV_RANDOM);
+
+    const file_header* header = reinterpret_cast<const file_header*>(map_);
+    if(std::memcmp(header->magic, capture_magic, sizeof(capture_magic)) != 0 ||
+            header->version != capture_version || header->record_size != sizeof(frame_record)) {
+        ::munmap(map, size_);
+        ::close(fd_);
+        throw std::runtime_error(path + " is not a version " + std::to_string(capture_version) + " capture file");
+    }
+
+    load_index();
+
+    // One inflate stream is reset for every segment instead of set up per segment
+    inflate_.reset(new z_stream_s());
+    if(inflateInit(inflate_.get()) != Z_OK) {
+        inflate_.reset();
+        ::munmap(map, size_);
+        ::close(fd_);
+        throw std::runtime_error("could not initialize decompression");
+    }
+}
+
+capture_reader::~capture_reader() {
+    if(inflate_)
+        inflateEnd(inflate_.get());
+
+    if(map_ != nullptr)
+        ::munmap(const_cast<uint8_t*>(map_), size_);
+
+    if(fd_ >= 0)
+        ::close(fd_);
+}
+
+/**
+ * @brief PRIVATE Load the index from the footer, or rebuild it if the capture wasn't closed
+ */
+void capture_reader::load_index() {
+    if(size_ >= sizeof(file_header) + sizeof(file_footer)) {
+        const file_footer* footer = reinterpret_cast<const file_footer*>(map_ + size_ - sizeof(file_footer));
+
+        if(footer->magic == footer_magic && footer->index_offset +
+                footer->block_count * sizeof(index_entry) + sizeof(file_footer) == size_) {
+            const index_entry* entries = reinterpret_cast<const index_entry*>(map_ + footer->index_offset);
+            index_.assign(entries, entries + footer->block_count);
+            return;
+        }
+    }
+
+    rebuild_index();
+}
+
+/**
+ * @brief PRIVATE Walk the block headers, a truncated last block is ignored
+ */
+void capture_reader::rebuild_index() {
+    uint64_t offset = sizeof(file_header);
+
+    index_.clear();
+    index_rebuilt_ = true;
+
+    while(offset + sizeof(block_header) <= size_) {
+        const block_header* header = reinterpret_cast<const block_header*>(map_ + offset);
+
+        if(header->magic != block_magic || offset + sizeof(block_header) + header->compressed_size > size_)
+            break;
+
+        index_.push_back({ offset, *header });
+        offset += sizeof(block_header) + header->compressed_size;
+    }
+}
+
+/**
+ * @brief PRIVATE Get a block's segment table, checking it fits the block
+ *
+ * @param entry
+ * @return const segment_entry*
+ */
+const segment_entry* capture_reader::segment_table(const index_entry& entry) const {
+    if(static_cast<uint64_t>(entry.header.segment_count) * sizeof(segment_entry) > entry.header.compressed_size)
+        throw std::runtime_error("corrupt segment table at offset " + std::to_string(entry.offset));
+
+    return reinterpret_cast<const segment_entry*>(map_ + entry.offset + sizeof(block_header));
+}
+
+/**
+ * @brief PRIVATE Decompress one segment of a block
+ *
+ * @param entry
+ * @param segment
+ * @param dst must fit segment.raw_size bytes
+ */
+void capture_reader::decompress_segment(const index_entry& entry, const segment_entry& segment, uint8_t* dst) {
+    size_t table_size = entry.header.segment_count * sizeof(segment_entry);
+    const uint8_t* compressed = map_ + entry.offset + sizeof(block_header) + table_size;
+
+    if(static_cast<uint64_t>(segment.compressed_offset) + segment.compressed_size > entry.header.compressed_size - table_size ||
+            segment.raw_size < static_cast<uint64_t>(segment.record_count) * sizeof(frame_record))
+        throw std::runtime_error("corrupt segment at offset " + std::to_string(entry.offset));
+
+    inflate_->next_in = const_cast<Bytef*>(compressed + segment.compressed_offset);
+    inflate_->avail_in = segment.compressed_size;
+    inflate_->next_out = dst;
+    inflate_->avail_out = segment.raw_size;
+
+    int result = inflate(inflate_.get(), Z_FINISH);
+    size_t raw_size = inflate_->total_out;
+    inflateReset(inflate_.get());
+
+    if(result != Z_STREAM_END || raw_size != segment.raw_size)
+        throw std::runtime_error("corrupt segment at offset " + std::to_string(entry.offset));
+
+    segments_decompressed_++;
+}
+
+/**
+ * @brief Visit every record in the capture
+ *
+ * @param callback
+ */
+void capture_reader::for_each(const record_callback& callback) {
+    scan(0, UINT64_MAX, nullptr, callback);
+}
+
+/**
+ * @brief Visit every record with from_us <= timestamp <= to_us
+ *
+ * @param from_us
+ * @param to_us
+ * @param callback
+ */
+void capture_reader::for_each_in_range(uint64_t from_us, uint64_t to_us, const record_callback& callback) {
+    scan(from_us, to_us, nullptr, callback);
+}
+
+/**
+ * @brief Visit every record of one ID, blocks whose bitmap doesn't have the ID are skipped and
+ * only the ID's segment is decompressed in the others
+ *
+ * @param id
+ * @param callback
+ */
+void capture_reader::for_each_with_id(uint32_t id, const record_callback& callback) {
+    scan(0, UINT64_MAX, &id, callback);
+}
+
+/**
+ * @brief Visit every record of one ID with from_us <= timestamp <= to_us
+ *
+ * @param id
+ * @param from_us
+ * @param to_us
+ * @param callback
+ */
+void capture_reader::for_each_with_id_in_range(uint32_t id, uint64_t from_us, uint64_t to_us, const record_callback& callback) {
+    scan(from_us, to_us, &id, callback);
+}
+
+/**
+ * @brief PRIVATE Build the record for a frame, resolving a payload kept in the overflow area
+ *
+ * @param entry block the frame came from, for error messages
+ * @param frame
+ * @param overflow the overflow area of the frame's segment
+ * @param overflow_size
+ * @return capture_record
+ */
+static capture_record make_record(const index_entry& entry, const frame_record& frame, const uint8_t* overflow, size_t overflow_size) {
+    capture_record record = {
+        frame.timestamp_us,
+        frame.id,
+        static_cast<record_type>(frame.type),
+        frame.data,
+        frame.length
+    };
+
+    if(frame.length > inline_data_len) {
+        uint32_t overflow_offset;
+        std::memcpy(&overflow_offset, frame.data, sizeof(overflow_offset));
+
+        if(static_cast<size_t>(overflow_offset) + frame.length > overflow_size)
+            throw std::runtime_error("corrupt record overflow at offset " + std::to_string(entry.offset));
+
+        record.data = overflow + overflow_offset;
+    }
+
+    return record;
+}
+
+/**
+ * @brief PRIVATE Decompress the blocks that overlap the time range and visit the matching
+ * records. With an ID only the blocks with the ID in their bitmap are read, and of those only the
+ * ID's segment. Without one every segment is decompressed and the records are visited in time
+ * order.
+ *
+ * @param from_us
+ * @param to_us
+ * @param id nullptr for any ID
+ * @param callback
+ */
+void capture_reader::scan(uint64_t from_us, uint64_t to_us, const uint32_t* id, const record_callback& callback) {
+    for(const index_entry& entry : index_) {
+        if(entry.header.last_timestamp_us < from_us || entry.header.first_timestamp_us > to_us)
+            continue;
+
+        if(id != nullptr && !id_bitmap_test(entry.header.id_bitmap, *id))
+            continue;
+
+        const segment_entry* segments = segment_table(entry);
+        const segment_entry* segments_end = segments + entry.header.segment_count;
+
+        if(id != nullptr) {
+            // The bitmap can share bits between 29 bit IDs, the table has the exact IDs
+            const segment_entry* segment = std::lower_bound(segments, segments_end, *id,
+                [](const segment_entry& lhs, uint32_t rhs) { return lhs.id < rhs; });
+
+            if(segment == segments_end || segment->id != *id)
+                continue;
+
+            block_.resize(segment->raw_size);
+            decompress_segment(entry, *segment, block_.data());
+            blocks_decompressed_++;
+
+            const frame_record* frames = reinterpret_cast<const frame_record*>(block_.data());
+            size_t records_size = segment->record_count * sizeof(frame_record);
+
+            for(uint32_t i = 0; i < segment->record_count; i++) {
+                if(frames[i].timestamp_us >= from_us && frames[i].timestamp_us <= to_us)
+                    callback(make_record(entry, frames[i], block_.data() + records_size, block_.size() - records_size));
+            }
+            continue;
+        }
+
+        block_.resize(entry.header.raw_size);
+        pending_.clear();
+
+        size_t offset = 0;
+
+        for(const segment_entry* segment = segments; segment != segments_end; segment++) {
+            if(offset + segment->raw_size > block_.size())
+                throw std::runtime_error("corrupt block at offset " + std::to_string(entry.offset));
+
+            uint8_t* raw = block_.data() + offset;
+            decompress_segment(entry, *segment, raw);
+
+            const frame_record* frames = reinterpret_cast<const frame_record*>(raw);
+            size_t records_size = segment->record_count * sizeof(frame_record);
+
+            for(uint32_t i = 0; i < segment->record_count; i++) {
+                if(frames[i].timestamp_us >= from_us && frames[i].timestamp_us <= to_us)
+                    pending_.push_back({ &frames[i], raw + records_size, segment->raw_size - records_size });
+            }
+
+            offset += segment->raw_size;
+        }
+
+        blocks_decompressed_++;
+
+        std::stable_sort(pending_.begin(), pending_.end(), [](const pending_record& lhs, const pending_record& rhs) {
+            return lhs.frame->timestamp_us < rhs.frame->timestamp_us;
+        });
+
+        for(const pending_record& pending : pending_)
+            callback(make_record(entry, *pending.frame, pending.overflow, pending.overflow_size));
+    }
+}
+
+}
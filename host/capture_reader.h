@@ -0,0 +1,69 @@
+#ifndef _CAPTURE_READER_H_
+#define _CAPTURE_READER_H_
+
+#include "capture_format.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct z_stream_s;
+
+namespace canshark {
+
+/**
+ * @brief Memory maps a capture file and answers time range and ID queries by decompressing only
+ * the blocks the index says can match, and for ID queries only that ID's segment of each block.
+ * Throws std::runtime_error on I/O or format errors.
+ */
+class capture_reader {
+public:
+    using record_callback = std::function<void(const capture_record&)>;
+
+    explicit capture_reader(const std::string& path);
+    ~capture_reader();
+
+    capture_reader(const capture_reader&) = delete;
+    capture_reader& operator=(const capture_reader&) = delete;
+
+    void for_each(const record_callback& callback);
+    void for_each_in_range(uint64_t from_us, uint64_t to_us, const record_callback& callback);
+    void for_each_with_id(uint32_t id, const record_callback& callback);
+    void for_each_with_id_in_range(uint32_t id, uint64_t from_us, uint64_t to_us, const record_callback& callback);
+
+    const std::vector<index_entry>& index() const { return index_; }
+    uint64_t blocks_decompressed() const { return blocks_decompressed_; }
+    uint64_t segments_decompressed() const { return segments_decompressed_; }
+    bool index_rebuilt() const { return index_rebuilt_; }
+
+private:
+    void load_index();
+    void rebuild_index();
+    const segment_entry* segment_table(const index_entry& entry) const;
+    void decompress_segment(const index_entry& entry, const segment_entry& segment, uint8_t* dst);
+    void scan(uint64_t from_us, uint64_t to_us, const uint32_t* id, const record_callback& callback);
+
+    int fd_ = -1;
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+
+    std::vector<index_entry> index_;
+    // A decompressed block's records in time order, full scans merge the segments through it
+    struct pending_record {
+        const frame_record* frame;
+        const uint8_t* overflow;
+        size_t overflow_size;
+    };
+
+    std::vector<uint8_t> block_;
+    std::vector<pending_record> pending_;
+    std::unique_ptr<z_stream_s> inflate_;
+    uint64_t blocks_decompressed_ = 0;
+    uint64_t segments_decompressed_ = 0;
+    bool index_rebuilt_ = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include "capture_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace canshark {
+
+/**
+ * @brief Create the capture file and write its header
+ *
+ * @param path
+ * @param block_records records per compressed block, larger blocks compress better but make
+ * seeks decompress more
+ */
+capture_writer::capture_writer(const std::string& path, uint32_t block_records)
+    : block_records_(block_records) {
+    if(block_records_ == 0)
+        throw std::invalid_argument("block_records must be greater than zero");
+
+    file_ = std::fopen(path.c_str(), "wb");
+    if(file_ == nullptr)
+        throw std::runtime_error("could not create " + path);
+
+    file_header header = {};
+    std::memcpy(header.magic, capture_magic, sizeof(header.magic));
+    header.version = capture_version;
+    header.record_size = sizeof(frame_record);
+    header.block_records = block_records_;
+    header.created_unix_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    if(std::fwrite(&header, sizeof(header), 1, file_) != 1)
+        throw std::runtime_error("could not write the file header");
+
+    offset_ = sizeof(header);
+    records_.reserve(block_records_);
+
+    // One deflate stream is reset for every segment, a fresh one per segment costs more than
+    // compressing a small segment. Segments are a few KiB, so a small hash table does as well as
+    // the default and is much cheaper to clear on every reset.
+    deflate_.reset(new z_stream_s());
+    if(deflateInit2(deflate_.get(), Z_BEST_SPEED, Z_DEFLATED, 15, 4, Z_DEFAULT_STRATEGY) != Z_OK) {
+        deflate_.reset();
+        throw std::runtime_error("could not initialize compression");
+    }
+}
+
+capture_writer::~capture_writer() {
+    try {
+        close();
+    } catch(...) {
+        // Destructors can't throw, call close() directly to see errors
+    }
+
+    if(deflate_)
+        deflateEnd(deflate_.get());
+}
+
+/**
+ * @brief Append a record, the block is compressed and written once it is full
+ *
+ * @param record
+ */
+void capture_writer::append(const capture_record& record) {
+    if(file_ == nullptr)
+        throw std::logic_error("append on a closed capture_writer");
+
+    frame_record frame = {};
+    frame.timestamp_us = record.timestamp_us;
+    frame.id = record.id;
+    frame.type = static_cast<uint16_t>(record.type);
+    frame.length = static_cast<uint16_t>(record.length);
+
+    if(record.length <= inline_data_len) {
+        std::memcpy(frame.data, record.data, record.length);
+    } else {
+        uint32_t overflow_offset = static_cast<uint32_t>(overflow_.size());
+        std::memcpy(frame.data, &overflow_offset, sizeof(overflow_offset));
+        overflow_.insert(overflow_.end(), record.data, record.data + record.length);
+    }
+
+    records_.push_back(frame);
+    record_count_++;
+
+    if(records_.size() == block_records_)
+        write_block();
+}
+
+/**
+ * @brief Write the current partial block so live readers see everything appended so far
+ */
+void capture_writer::flush() {
+    if(file_ == nullptr)
+        return;
+
+    write_block();
+    std::fflush(file_);
+}
+
+/**
+ * @brief Write the last block, the index and the footer
+ */
+void capture_writer::close() {
+    if(file_ == nullptr)
+        return;
+
+    write_block();
+
+    file_footer footer = {};
+    footer.index_offset = offset_;
+    footer.block_count = index_.size();
+    footer.record_count = record_count_;
+    footer.magic = footer_magic;
+
+    bool ok = index_.empty() || std::fwrite(index_.data(), sizeof(index_entry), index_.size(), file_) == index_.size();
+    ok = ok && std::fwrite(&footer, sizeof(footer), 1, file_) == 1;
+    ok = std::fclose(file_) == 0 && ok;
+    file_ = nullptr;
+
+    if(!ok)
+        throw std::runtime_error("could not write the capture index");
+}
+
+/**
+ * @brief PRIVATE Compress the raw segment buffer onto the end of the compressed buffer
+ */
+void capture_writer::compress_segment() {
+    size_t offset = compressed_.size();
+
+    compressed_.resize(offset + deflateBound(deflate_.get(), raw_.size()));
+
+    deflate_->next_in = raw_.data();
+    deflate_->avail_in = static_cast<uInt>(raw_.size());
+    deflate_->next_out = compressed_.data() + offset;
+    deflate_->avail_out = static_cast<uInt>(compressed_.size() - offset);
+
+    int result = deflate(deflate_.get(), Z_FINISH);
+    size_t compressed_size = deflate_->total_out;
+    deflateReset(deflate_.get());
+
+    if(result != Z_STREAM_END)
+        throw std::runtime_error("could not compress a block");
+
+    compressed_.resize(offset + compressed_size);
+}
+
+/**
+ * @brief PRIVATE Compress and write the buffered records as one block, split into one segment
+ * per ID
+ */
+void capture_writer::write_block() {
+    if(records_.empty())
+        return;
+
+    block_header header = {};
+    header.magic = block_magic;
+    header.record_count = static_cast<uint32_t>(records_.size());
+    header.first_timestamp_us = records_.front().timestamp_us;
+    header.last_timestamp_us = records_.front().timestamp_us;
+
+    // Channels are timed separately, a telemetry record can land between two capture records
+    // with a slightly earlier time, so the block range is the min / max rather than first / last
+    for(const frame_record& frame : records_) {
+        id_bitmap_set(header.id_bitmap, frame.id);
+        header.first_timestamp_us = std::min(header.first_timestamp_us, frame.timestamp_us);
+        header.last_timestamp_us = std::max(header.last_timestamp_us, frame.timestamp_us);
+    }
+
+    // A stable sort by ID keeps every segment in capture order
+    order_.resize(records_.size());
+    std::iota(order_.begin(), order_.end(), 0);
+    std::stable_sort(order_.begin(), order_.end(), [&](uint32_t a, uint32_t b) {
+        return records_[a].id < records_[b].id;
+    });
+
+    segments_.clear();
+    compressed_.clear();
+    size_t raw_size = 0;
+
+    for(size_t start = 0; start < order_.size(); ) {
+        uint32_t id = records_[order_[start]].id;
+        size_t end = start;
+
+        raw_.clear();
+        segment_overflow_.clear();
+
+        // Payloads that don't fit inline move to the segment's own overflow area
+        for(; end < order_.size() && records_[order_[end]].id == id; end++) {
+            frame_record frame = records_[order_[end]];
+
+            if(frame.length > inline_data_len) {
+                uint32_t overflow_offset;
+                std::memcpy(&overflow_offset, frame.data, sizeof(overflow_offset));
+                segment_overflow_.insert(segment_overflow_.end(), overflow_.begin() + overflow_offset,
+                    overflow_.begin() + overflow_offset + frame.length);
+
+                overflow_offset = static_cast<uint32_t>(segment_overflow_.size() - frame.length);
+                std::memcpy(frame.data, &overflow_offset, sizeof(overflow_offset));
+            }
+
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&frame);
+            raw_.insert(raw_.end(), bytes, bytes + sizeof(frame));
+        }
+
+        raw_.insert(raw_.end(), segment_overflow_.begin(), segment_overflow_.end());
+
+        segment_entry segment = {};
+        segment.id = id;
+        segment.record_count = static_cast<uint32_t>(end - start);
+        segment.raw_size = static_cast<uint32_t>(raw_.size());
+        segment.compressed_offset = static_cast<uint32_t>(compressed_.size());
+
+        compress_segment();
+
+        segment.compressed_size = static_cast<uint32_t>(compressed_.size() - segment.compressed_offset);
+        segments_.push_back(segment);
+        raw_size += raw_.size();
+        start = end;
+    }
+
+    size_t table_size = segments_.size() * sizeof(segment_entry);
+
+    header.segment_count = static_cast<uint32_t>(segments_.size());
+    header.raw_size = static_cast<uint32_t>(raw_size);
+    header.compressed_size = static_cast<uint32_t>(table_size + compressed_.size());
+
+    if(std::fwrite(&header, sizeof(header), 1, file_) != 1 ||
+            std::fwrite(segments_.data(), sizeof(segment_entry), segments_.size(), file_) != segments_.size() ||
+            std::fwrite(compressed_.data(), 1, compressed_.size(), file_) != compressed_.size())
+        throw std::runtime_error("could not write a block");
+
+    index_.push_back({ offset_, header });
+    offset_ += sizeof(header) + header.compressed_size;
+
+    records_.clear();
+    overflow_.clear();
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef _CAPTURE_WRITER_H_
+#define _CAPTURE_WRITER_H_
+
+#include "capture_format.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct z_stream_s;
+
+namespace canshark {
+
+/**
+ * @brief Appends records to a capture file one compressed block at a time. Throws
+ * std::runtime_error on I/O or compression errors.
+ */
+class capture_writer {
+public:
+    explicit capture_writer(const std::string& path, uint32_t block_records = default_block_records);
+    ~capture_writer();
+
+    capture_writer(const capture_writer&) = delete;
+    capture_writer& operator=(const capture_writer&) = delete;
+
+    void append(const capture_record& record);
+    void flush();
+    void close();
+
+    uint64_t record_count() const { return record_count_; }
+
+private:
+    void write_block();
+    void compress_segment();
+
+    FILE* file_ = nullptr;
+    uint32_t block_records_;
+    uint64_t offset_ = 0;
+    uint64_t record_count_ = 0;
+
+    std::vector<frame_record> records_;
+    std::vector<uint8_t> overflow_;
+    std::vector<uint8_t> raw_;
+    std::vector<uint8_t> compressed_;
+    std::vector<index_entry> index_;
+
+    // Per block scratch for splitting the records into one segment per ID
+    std::vector<uint32_t> order_;
+    std::vector<uint8_t> segment_overflow_;
+    std::vector<segment_entry> segments_;
+    std::unique_ptr<z_stream_s> deflate_;
+};
+
+}
+
+#endif
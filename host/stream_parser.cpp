@@ -0,0 +1,224 @@
+#include "stream_parser.h"
+
+#include <algorithm>
+#include <array>
+
+namespace canshark {
+
+// Channel (1) + length (4) + crc16 (2)
+constexpr size_t frame_header_len = 5;
+constexpr size_t frame_overhead = frame_header_len + sizeof(uint16_t);
+// Time (4) + type (2) + id (4)
+constexpr size_t record_header_len = 10;
+constexpr size_t max_message_len = 8192;
+
+/**
+ * @brief PRIVATE Build the reflected CCITT table the firmware uses (poly 0x8408)
+ */
+static std::array<uint16_t, 256> make_crc_table() {
+    std::array<uint16_t, 256> table = {};
+
+    for(uint32_t i = 0; i < 256; i++) {
+        uint16_t crc = static_cast<uint16_t>(i);
+
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+
+        table[i] = crc;
+    }
+
+    return table;
+}
+
+/**
+ * @brief Same crc16_update as main/comms.c, for checksums over more than one buffer
+ */
+uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t len) {
+    static const std::array<uint16_t, 256> table = make_crc_table();
+
+    for(size_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xff];
+
+    return crc;
+}
+
+/**
+ * @brief Same crc16 as calculate_crc16 in main/comms.c
+ */
+uint16_t calculate_crc16(const uint8_t* data, size_t len) {
+    return crc16_update(0xffff, data, len) ^ 0xffff;
+}
+
+static uint32_t read_be32(const uint8_t* data) {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+static uint16_t read_be16(const uint8_t* data) {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+static int hex_value(uint8_t c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+stream_parser::stream_parser(record_callback callback, message_callback messages)
+    : callback_(std::move(callback)), messages_(std::move(messages)) {
+}
+
+/**
+ * @brief Feed bytes as they arrive from the device, callback is called for every complete record
+ *
+ * @param data
+ * @param len
+ */
+void stream_parser::feed(const uint8_t* data, size_t len) {
+    pending_.insert(pending_.end(), data, data + len);
+
+    size_t pos = 0;
+
+    while(pos < pending_.size()) {
+        size_t consumed = pending_[pos] == '<' ? parse_hex(pos) : parse_binary(pos);
+
+        // Need more data
+        if(consumed == 0)
+            break;
+
+        pos += consumed;
+    }
+
+    pending_.erase(pending_.begin(), pending_.begin() + pos);
+}
+
+/**
+ * @brief PRIVATE Parse a "<HEX>\n" message starting at pos
+ *
+ * @param pos
+ * @return size_t bytes consumed, 0 if the message isn't complete yet
+ */
+size_t stream_parser::parse_hex(size_t pos) {
+    auto begin = pending_.begin() + pos;
+    auto end = std::find(begin, pending_.end(), '\n');
+
+    if(end == pending_.end()) {
+        // Nothing that long is a message, skip the '<' and resync
+        if(static_cast<size_t>(pending_.end() - begin) > max_message_len * 2 + 3) {
+            skipped_bytes_++;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    size_t line_len = end - begin + 1;
+    auto close = std::find(begin, end, '>');
+    size_t hex_len = close - begin - 1;
+
+    decoded_.clear();
+
+    bool valid = close != end && hex_len % 2 == 0;
+
+    for(size_t i = 0; valid && i < hex_len; i += 2) {
+        int high = hex_value(begin[1 + i]);
+        int low = hex_value(begin[2 + i]);
+
+        valid = high >= 0 && low >= 0;
+        decoded_.push_back(static_cast<uint8_t>((high << 4) | low));
+    }
+
+    if(!valid || !decode_message(decoded_.data(), decoded_.size()))
+        skipped_bytes_ += line_len;
+
+    return line_len;
+}
+
+/**
+ * @brief PRIVATE Parse a binary message starting at pos
+ *
+ * @param pos
+ * @return size_t bytes consumed, 0 if the message isn't complete yet
+ */
+size_t stream_parser::parse_binary(size_t pos) {
+    size_t available = pending_.size() - pos;
+
+    if(pending_[pos] >= channel_count) {
+        skipped_bytes_++;
+        return 1;
+    }
+
+    if(available < frame_header_len)
+        return 0;
+
+    uint32_t len = read_be32(&pending_[pos + 1]);
+
+    if(len > max_message_len) {
+        skipped_bytes_++;
+        return 1;
+    }
+
+    size_t message_len = frame_overhead + len;
+
+    if(available < message_len)
+        return 0;
+
+    if(!decode_message(&pending_[pos], message_len)) {
+        skipped_bytes_++;
+        return 1;
+    }
+
+    return message_len;
+}
+
+/**
+ * @brief PRIVATE Check and decode one framed message: channel (1), length (4), payload,
+ * crc16 (2), all big endian. The crc16 covers the channel and payload. Record payloads are
+ * time (4), type (2), id (4), data.
+ *
+ * @param message
+ * @param len
+ * @return true the message was valid
+ * @return false
+ */
+bool stream_parser::decode_message(const uint8_t* message, size_t len) {
+    if(len < frame_overhead || message[0] >= channel_count || read_be32(message + 1) != len - frame_overhead)
+        return false;
+
+    const uint8_t* payload = message + frame_header_len;
+    size_t payload_len = len - frame_overhead;
+    uint16_t crc = crc16_update(crc16_update(0xffff, message, 1), payload, payload_len) ^ 0xffff;
+
+    if(crc != read_be16(payload + payload_len)) {
+        crc_errors_++;
+        return false;
+    }
+
+    channel source = static_cast<channel>(message[0]);
+
+    if(source == channel::control || source == channel::log) {
+        if(messages_)
+            messages_(source, payload, payload_len);
+        return true;
+    }
+
+    if(payload_len < record_header_len)
+        return false;
+
+    uint64_t& time_us = time_us_[message[0]];
+    time_us += read_be32(payload);
+
+    capture_record record = {
+        time_us,
+        read_be32(payload + 6),
+        static_cast<record_type>(read_be16(payload + 4)),
+        payload + record_header_len,
+        payload_len - record_header_len
+    };
+
+    callback_(record);
+
+    return true;
+}
+
+}
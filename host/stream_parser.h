@@ -0,0 +1,62 @@
+#ifndef _STREAM_PARSER_H_
+#define _STREAM_PARSER_H_
+
+#include "capture_format.h"
+
+#include <array>
+#include <functional>
+#include <vector>
+
+namespace canshark {
+
+// Matches comms_channel in main/comms.h
+enum class channel : uint8_t {
+    control = 0,
+    telemetry = 1,
+    log = 2,
+    capture = 3
+};
+
+constexpr size_t channel_count = 4;
+
+/**
+ * @brief Turns the raw device UART stream into records. Handles both output modes: hex
+ * ("<HEX>\n" per message) and binary (channel, length, payload, crc16). Anything that isn't a
+ * valid message (boot ROM output, corrupted messages) is skipped.
+ *
+ * Capture and telemetry channel payloads are records, their times on the wire are deltas to the
+ * previous record on the same channel and are accumulated into microseconds since the start of
+ * the stream. Control and log channel payloads go to the optional message callback as is.
+ */
+class stream_parser {
+public:
+    using record_callback = std::function<void(const capture_record&)>;
+    using message_callback = std::function<void(channel, const uint8_t*, size_t)>;
+
+    explicit stream_parser(record_callback callback, message_callback messages = nullptr);
+
+    void feed(const uint8_t* data, size_t len);
+
+    uint64_t crc_errors() const { return crc_errors_; }
+    uint64_t skipped_bytes() const { return skipped_bytes_; }
+
+private:
+    size_t parse_hex(size_t pos);
+    size_t parse_binary(size_t pos);
+    bool decode_message(const uint8_t* message, size_t len);
+
+    record_callback callback_;
+    message_callback messages_;
+    std::vector<uint8_t> pending_;
+    std::vector<uint8_t> decoded_;
+    std::array<uint64_t, channel_count> time_us_ = {};
+    uint64_t crc_errors_ = 0;
+    uint64_t skipped_bytes_ = 0;
+};
+
+uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t len);
+uint16_t calculate_crc16(const uint8_t* data, size_t len);
+
+}
+
+#endif
@@ -0,0 +1,304 @@
+#include "backpressure.h"
+#include "can_bus.h"
+#include "comms.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <lwip/sockets.h>
+
+typedef struct backpressure_id_entry_t {
+    uint32_t key;               // CAN ID with the extended flag in the top bit
+    bool used;
+    int64_t last_forward_time;
+    uint32_t count;             // Frames summarized since the last summary record
+    uint8_t dlc;
+    uint8_t data[8];            // Most recent data for the summary record
+} backpressure_id_entry_t;
+
+/// Private variables
+static backpressure_id_entry_t id_table[BACKPRESSURE_ID_TABLE_LEN];
+
+// Requested by the host command task, applied by the CAN task in backpressure_update
+static volatile backpressure_policy_t requested_policy = BACKPRESSURE_DROP_NEWEST;
+static volatile uint32_t requested_interval_ms = BACKPRESSURE_DEFAULT_INTERVAL_MS;
+
+static backpressure_policy_t active_policy = BACKPRESSURE_DROP_NEWEST;
+static int64_t interval_us = BACKPRESSURE_DEFAULT_INTERVAL_MS * 1000;
+static backpressure_state_t state = BACKPRESSURE_NORMAL;
+
+static int64_t last_report_time = 0;
+
+// Drop counters are touched from any task that queues a message
+static portMUX_TYPE drop_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t total_drop_count = 0;
+static uint32_t report_drop_count = 0;
+static uint32_t first_drop_time = 0;
+static uint32_t last_drop_time = 0;
+
+/// Private function pre declarations
+static void send_event_record();
+static void send_drop_report();
+static void send_summaries();
+
+/**
+ * @brief Set the overload policy, it is applied by the CAN task on its next update
+ *
+ * @param policy policy used while the message queue is over the high water mark
+ * @param interval_ms decimation / summary / drop report interval
+ * @return esp_err_t
+ */
+esp_err_t backpressure_set_policy(backpressure_policy_t policy, uint32_t interval_ms) {
+    if(policy >= BACKPRESSURE_POLICY_COUNT || interval_ms == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    requested_interval_ms = interval_ms;
+    requested_policy = policy;
+
+    return ESP_OK;
+}
+
+/**
+ * @brief PRIVATE Find or insert the table entry for a CAN ID
+ *
+ * @param message
+ * @return backpressure_id_entry_t* NULL if the table is full
+ */
+HOT_PATH_ATTR static backpressure_id_entry_t* find_id_entry(const twai_message_t* message) {
+    uint32_t key = message->identifier | (message->extd ? 0x80000000 : 0);
+    size_t index = (key * 2654435761u) % BACKPRESSURE_ID_TABLE_LEN;
+
+    for(size_t i = 0; i < BACKPRESSURE_ID_TABLE_LEN; i++) {
+        backpressure_id_entry_t* entry = &id_table[(index + i) % BACKPRESSURE_ID_TABLE_LEN];
+
+        if(!entry->used) {
+            memset(entry, 0, sizeof(backpressure_id_entry_t));
+            entry->used = true;
+            entry->key = key;
+            return entry;
+        }
+
+        if(entry->key == key)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Decide whether a received frame should be queued, called by the CAN task for every frame
+ *
+ * @param message received frame
+ * @param time receive time in microseconds
+ * @return true the frame should be queued
+ * @return false the frame was dropped or folded into a summary
+ */
+HOT_PATH_ATTR bool backpressure_admit(const twai_message_t* message, int64_t time) {
+    if(state == BACKPRESSURE_NORMAL)
+        return true;
+
+    backpressure_id_entry_t* entry = NULL;
+
+    switch(active_policy) {
+        case BACKPRESSURE_DROP_NEWEST:
+            //add_message drops the frame if it really doesn't fit
+            return true;
+
+        case BACKPRESSURE_DROP_OLDEST:
+            backpressure_count_drops(comms_drop_oldest(MESSAGE_QUEUE_ITEM_SIZE));
+            return true;
+
+        case BACKPRESSURE_DECIMATE:
+            entry = find_id_entry(message);
+
+            // Untracked IDs are forwarded, every ID keeps at least one frame per interval
+            if(entry == NULL)
+                return true;
+
+            if(entry->last_forward_time == 0 || time - entry->last_forward_time >= interval_us) {
+                entry->last_forward_time = time;
+                return true;
+            }
+
+            backpressure_count_drops(1);
+            return false;
+
+        case BACKPRESSURE_SUMMARIZE:
+            entry = find_id_entry(message);
+
+            if(entry == NULL)
+                return true;
+
+            entry->count++;
+            entry->dlc = message->data_length_code > 8 ? 8 : message->data_length_code;
+            memcpy(entry->data, message->data, entry->dlc);
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/**
+ * @brief Track the queue fill level, apply policy changes and send the periodic records.
+ * Called by the CAN task every loop, frame or not.
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR void backpressure_update(int64_t time) {
+    if(requested_policy != active_policy || (int64_t)requested_interval_ms * 1000 != interval_us) {
+        if(active_policy == BACKPRESSURE_SUMMARIZE)
+            send_summaries();
+
+        active_policy = requested_policy;
+        interval_us = (int64_t)requested_interval_ms * 1000;
+        memset(id_table, 0, sizeof(id_table));
+
+        send_event_record();
+    }
+
+    uint8_t fill = comms_queue_fill();
+
+    if(state == BACKPRESSURE_NORMAL && fill >= BACKPRESSURE_HIGH_WATER) {
+        state = BACKPRESSURE_OVERLOADED;
+        last_report_time = time;
+
+        send_event_record();
+    } else if(state == BACKPRESSURE_OVERLOADED && fill <= BACKPRESSURE_LOW_WATER) {
+        if(active_policy == BACKPRESSURE_SUMMARIZE)
+            send_summaries();
+        send_drop_report();
+
+        // IDs seen during this overload don't hold table slots into the next one
+        memset(id_table, 0, sizeof(id_table));
+        state = BACKPRESSURE_NORMAL;
+
+        send_event_record();
+    }
+
+    if(time - last_report_time >= interval_us) {
+        if(state == BACKPRESSURE_OVERLOADED && active_policy == BACKPRESSURE_SUMMARIZE)
+            send_summaries();
+        send_drop_report();
+
+        last_report_time = time;
+    }
+}
+
+/**
+ * @brief Count dropped messages, safe to call from any task
+ *
+ * @param count
+ */
+HOT_PATH_ATTR void backpressure_count_drops(size_t count) {
+    if(count == 0)
+        return;
+
+    uint32_t now = (uint32_t)esp_timer_get_time();
+
+    portENTER_CRITICAL(&drop_lock);
+    if(report_drop_count == 0)
+        first_drop_time = now;
+    last_drop_time = now;
+    report_drop_count += count;
+    total_drop_count += count;
+    portEXIT_CRITICAL(&drop_lock);
+}
+
+/**
+ * @brief Get the total number of messages dropped since boot
+ *
+ * @return uint32_t
+ */
+uint32_t backpressure_get_drop_count() {
+    return total_drop_count;
+}
+
+/**
+ * @brief Get the current overload state
+ *
+ * @return backpressure_state_t
+ */
+backpressure_state_t backpressure_get_state() {
+    return state;
+}
+
+/**
+ * @brief PRIVATE Queue an ID_SUMMARY record, evicting old messages if needed so it gets through.
+ * Overload events and drop reports go out on the telemetry channel, where evictions can't reach
+ * them.
+ *
+ * @param id
+ * @param data
+ * @param data_len
+ */
+static void send_summary_record(uint32_t id, void* data, size_t data_len) {
+    backpressure_count_drops(comms_drop_oldest(MESSAGE_QUEUE_ITEM_SIZE + data_len));
+    can_bus_send_record(ID_SUMMARY, id, data, data_len);
+}
+
+/**
+ * @brief PRIVATE Send an OVERLOAD_EVENT record
+ *
+ * Data: state (1), policy (1), queue fill percent (1), interval ms (4), total drops (4)
+ */
+static void send_event_record() {
+    uint8_t data[11];
+    uint32_t net_interval = htonl((uint32_t)(interval_us / 1000));
+    uint32_t net_drops = htonl(total_drop_count);
+
+    data[0] = (uint8_t)state;
+    data[1] = (uint8_t)active_policy;
+    data[2] = comms_queue_fill();
+    memcpy(data + 3, &net_interval, sizeof(uint32_t));
+    memcpy(data + 7, &net_drops, sizeof(uint32_t));
+
+    can_bus_send_record(OVERLOAD_EVENT, 0, data, sizeof(data));
+}
+
+/**
+ * @brief PRIVATE Send a DROP_REPORT record if anything was dropped since the last one
+ *
+ * Data: dropped count (4), first drop time (4), last drop time (4), times are the low 32 bits
+ * of the microsecond clock
+ */
+static void send_drop_report() {
+    uint32_t count, first, last;
+
+    portENTER_CRITICAL(&drop_lock);
+    count = report_drop_count;
+    first = first_drop_time;
+    last = last_drop_time;
+    report_drop_count = 0;
+    portEXIT_CRITICAL(&drop_lock);
+
+    if(count == 0)
+        return;
+
+    uint32_t net_values[3] = { htonl(count), htonl(first), htonl(last) };
+
+    can_bus_send_record(DROP_REPORT, 0, net_values, sizeof(net_values));
+}
+
+/**
+ * @brief PRIVATE Send an ID_SUMMARY record for every ID seen since the last summary
+ *
+ * Data: frame count (4), dlc (1), last data (dlc)
+ */
+static void send_summaries() {
+    uint8_t data[sizeof(uint32_t) + 1 + 8];
+
+    for(size_t i = 0; i < BACKPRESSURE_ID_TABLE_LEN; i++) {
+        backpressure_id_entry_t* entry = &id_table[i];
+
+        if(!entry->used || entry->count == 0)
+            continue;
+
+        uint32_t net_count = htonl(entry->count);
+        memcpy(data, &net_count, sizeof(uint32_t));
+        data[sizeof(uint32_t)] = entry->dlc;
+        memcpy(data + sizeof(uint32_t) + 1, entry->data, entry->dlc);
+
+        send_summary_record(entry->key & 0x7FFFFFFF, data, sizeof(uint32_t) + 1 + entry->dlc);
+
+        entry->count = 0;
+    }
+}
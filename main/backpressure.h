@@ -0,0 +1,33 @@
+#ifndef _BACKPRESSURE_H_
+#define _BACKPRESSURE_H_
+
+#include "defines.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <driver/twai.h>
+
+typedef enum backpressure_policy_t {
+    BACKPRESSURE_DROP_NEWEST = 0,   // Drop incoming frames while the queue is full
+    BACKPRESSURE_DROP_OLDEST = 1,   // Evict the oldest queued messages to make room for new frames
+    BACKPRESSURE_DECIMATE = 2,      // Forward at most one frame per ID per interval
+    BACKPRESSURE_SUMMARIZE = 3,     // Replace frames with one summary record per ID per interval
+    BACKPRESSURE_POLICY_COUNT
+} backpressure_policy_t;
+
+typedef enum backpressure_state_t {
+    BACKPRESSURE_NORMAL = 0,
+    BACKPRESSURE_OVERLOADED = 1
+} backpressure_state_t;
+
+esp_err_t backpressure_set_policy(backpressure_policy_t policy, uint32_t interval_ms);
+
+bool backpressure_admit(const twai_message_t* message, int64_t time);
+void backpressure_update(int64_t time);
+void backpressure_count_drops(size_t count);
+
+uint32_t backpressure_get_drop_count();
+backpressure_state_t backpressure_get_state();
+
+#endif
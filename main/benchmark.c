@@ -0,0 +1,444 @@
+#include "benchmark.h"
+#include "can_bus.h"
+#include "comms.h"
+#include "backpressure.h"
+#include <string.h>
+#include <sdkconfig.h>
+
+#define BENCHMARK_CPU_UNAVAILABLE 0xFF
+
+typedef enum benchmark_state_t {
+    BENCHMARK_IDLE = 0,
+    BENCHMARK_SETTLING = 1,     // Waiting out a driver restart before the measurement window opens
+    BENCHMARK_RUNNING = 2
+} benchmark_state_t;
+
+// Snapshot of every counter the report is built from, taken at both ends of the run
+typedef struct benchmark_counters_t {
+    int64_t time;
+    uint32_t rx_overrun;        // Lost in the controller FIFO
+    uint32_t rx_missed;         // Lost because the driver RX queue was full
+    uint32_t total_drops;
+    uint32_t queue_drops;
+    uint32_t tx_bytes;
+    bool idle_valid;
+    uint32_t idle_time[portNUM_PROCESSORS];
+} benchmark_counters_t;
+
+/// Private variables
+// Requested by the host command task, picked up by the CAN task in benchmark_update
+static portMUX_TYPE request_lock = portMUX_INITIALIZER_UNLOCKED;
+static benchmark_profile_t requested_profile;
+static volatile bool requested = false;
+
+// Set by the CAN task once the report is sent, the status is restored in benchmark_restore
+static volatile bool finished = false;
+static bool saved_sniff;
+static uint32_t saved_bitrate;
+static can_config_t saved_config;
+
+static volatile benchmark_state_t state = BENCHMARK_IDLE;
+static benchmark_profile_t profile;
+static benchmark_counters_t start_counters;
+static int64_t settle_until = 0;
+static int64_t last_yield_time = 0;
+
+// Generator state
+static uint32_t sequence = 0;
+static uint32_t random_state = 1;
+static uint64_t next_due_ns = 0;
+static uint16_t burst_remaining = 0;
+static twai_message_t pending_frame;
+static bool have_pending_frame = false;
+
+static uint32_t frames_offered = 0;
+static uint32_t frames_received = 0;
+
+/// Private function pre declarations
+static void read_counters(benchmark_counters_t* counters, int64_t time);
+static void send_report(const benchmark_counters_t* end_counters);
+
+/**
+ * @brief Start a benchmark run, it is picked up by the CAN task on its next update. Sniffing is
+ * turned on for the run, and self test also switches the controller to no-ack mode at the
+ * profile bitrate. Everything is put back by benchmark_restore once the report is sent.
+ *
+ * @param profile
+ * @param status
+ * @return esp_err_t ESP_ERR_INVALID_STATE if a run is in progress, ESP_ERR_NOT_SUPPORTED if
+ * there is no timing preset for a self test bitrate
+ */
+esp_err_t benchmark_start(const benchmark_profile_t* profile, comms_status_t* status) {
+    twai_timing_config_t t_config;
+
+    if(benchmark_is_active())
+        return ESP_ERR_INVALID_STATE;
+
+    if(profile->source >= BENCHMARK_SOURCE_COUNT || profile->bitrate == 0 || profile->min_dlc > profile->max_dlc ||
+            profile->max_dlc > 8 || profile->id_count == 0 || profile->burst_len == 0 || profile->duration_ms == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    if(profile->source == BENCHMARK_SELF_TEST) {
+        // A real bus can't be offered more than it carries
+        if(profile->load_percent == 0 || profile->load_percent > 100)
+            return ESP_ERR_INVALID_ARG;
+
+        if(can_bus_timing_for_bitrate(profile->bitrate, &t_config) != ESP_OK)
+            return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    saved_sniff = status->sniff;
+    saved_bitrate = status->bitrate;
+    saved_config = status->current_config;
+
+    if(profile->source == BENCHMARK_SELF_TEST) {
+        status->current_config.t_config = t_config;
+        status->current_config.g_config.mode = TWAI_MODE_NO_ACK;
+        status->bitrate = profile->bitrate;
+        status->reconfigure = true;
+    }
+
+    status->sniff = true;
+
+    portENTER_CRITICAL(&request_lock);
+    requested_profile = *profile;
+    requested = true;
+    portEXIT_CRITICAL(&request_lock);
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Put the sniff state and CAN configuration back once a run has finished, called by the
+ * CAN task every loop
+ *
+ * @param status
+ */
+void benchmark_restore(comms_status_t* status) {
+    if(!finished)
+        return;
+
+    status->sniff = saved_sniff;
+
+    if(profile.source == BENCHMARK_SELF_TEST) {
+        status->bitrate = saved_bitrate;
+        status->current_config = saved_config;
+        status->reconfigure = true;
+    }
+
+    finished = false;
+}
+
+/**
+ * @brief Check if a run is requested, in progress or waiting to be restored
+ *
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR bool benchmark_is_active() {
+    return requested || state != BENCHMARK_IDLE || finished;
+}
+
+/**
+ * @brief Check if frames come from the generator instead of the controller
+ *
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR bool benchmark_is_injecting() {
+    return state == BENCHMARK_RUNNING && profile.source == BENCHMARK_INJECT;
+}
+
+/**
+ * @brief PRIVATE Next value of the generator's LCG, only the better mixed high bits are used
+ *
+ * @return uint32_t
+ */
+HOT_PATH_ATTR static uint32_t next_random() {
+    random_state = random_state * 1664525 + 1013904223;
+    return random_state >> 8;
+}
+
+/**
+ * @brief PRIVATE Build the next synthetic frame. The first four data bytes carry the sequence
+ * number so the host can find exactly which frames were lost.
+ *
+ * @param message
+ */
+HOT_PATH_ATTR static void generate_frame(twai_message_t* message) {
+    uint32_t id = BENCHMARK_BASE_ID + sequence % profile.id_count;
+
+    memset(message, 0, sizeof(twai_message_t));
+    message->extd = id > 0x7FF;
+    message->identifier = id;
+    message->data_length_code = profile.min_dlc + next_random() % (profile.max_dlc - profile.min_dlc + 1);
+
+    for(uint8_t i = 0; i < message->data_length_code; i++)
+        message->data[i] = i < sizeof(uint32_t) ? (uint8_t)(sequence >> (24 - 8 * i)) : (uint8_t)next_random();
+
+    sequence++;
+}
+
+/**
+ * @brief PRIVATE Check if the pacing allows another frame, starting a new burst if one is due
+ *
+ * @param time current time in microseconds
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR static bool frame_due(int64_t time) {
+    if(profile.load_percent == 0 || burst_remaining > 0)
+        return true;
+
+    if((uint64_t)time * 1000 < next_due_ns)
+        return false;
+
+    burst_remaining = profile.burst_len;
+
+    return true;
+}
+
+/**
+ * @brief PRIVATE Account for a frame put on the bus / into the pipeline. The schedule advances
+ * by the frame's bus time scaled by the offered load, stuff bits are not counted.
+ *
+ * @param message
+ */
+HOT_PATH_ATTR static void frame_offered(const twai_message_t* message) {
+    uint32_t bits = (message->extd ? 67 : 47) + 8 * message->data_length_code;
+
+    frames_offered++;
+
+    if(burst_remaining > 0)
+        burst_remaining--;
+
+    if(profile.load_percent != 0)
+        next_due_ns += (uint64_t)bits * 100000000000ULL / ((uint64_t)profile.bitrate * profile.load_percent);
+}
+
+/**
+ * @brief Produce the next synthetic frame while an inject run is in progress, called by the CAN
+ * task in place of twai_receive
+ *
+ * @param message
+ * @param time current time in microseconds
+ * @return true a frame is due and was written to message
+ * @return false
+ */
+HOT_PATH_ATTR bool benchmark_inject(twai_message_t* message, int64_t time) {
+    if(!benchmark_is_injecting() || !frame_due(time))
+        return false;
+
+    generate_frame(message);
+    frame_offered(message);
+
+    return true;
+}
+
+/**
+ * @brief Count a frame that entered the receive pipeline, called by the CAN task for every frame
+ *
+ */
+HOT_PATH_ATTR void benchmark_count_frame() {
+    if(state == BENCHMARK_RUNNING)
+        frames_received++;
+}
+
+/**
+ * @brief PRIVATE Queue every due frame for transmission, frames are received back through the
+ * controller as self reception requests
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR static void transmit_due(int64_t time) {
+    while(have_pending_frame || frame_due(time)) {
+        if(!have_pending_frame) {
+            generate_frame(&pending_frame);
+            pending_frame.self = 1;
+            have_pending_frame = true;
+        }
+
+        // TX queue full, try again on the next update
+        if(twai_transmit(&pending_frame, 0) != ESP_OK)
+            return;
+
+        have_pending_frame = false;
+        frame_offered(&pending_frame);
+    }
+}
+
+/**
+ * @brief PRIVATE Block for a tick when no injected frame is due. An inject run never waits on the
+ * controller, so an overloaded or unthrottled run also gives the idle task a tick every
+ * BENCHMARK_YIELD_MS to keep the task watchdog fed.
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR static void pace_injection(int64_t time) {
+    bool idle = profile.load_percent != 0 && burst_remaining == 0 && (uint64_t)time * 1000 < next_due_ns;
+
+    if(idle || time - last_yield_time >= BENCHMARK_YIELD_MS * 1000) {
+        vTaskDelay(1);
+        last_yield_time = time;
+    }
+}
+
+/**
+ * @brief Start requested runs, generate self test traffic and finish runs once their duration is
+ * up. Called by the CAN task every loop, frame or not.
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR void benchmark_update(int64_t time) {
+    if(requested) {
+        portENTER_CRITICAL(&request_lock);
+        profile = requested_profile;
+        requested = false;
+        portEXIT_CRITICAL(&request_lock);
+
+        state = BENCHMARK_SETTLING;
+        settle_until = time + BENCHMARK_SETTLE_MS * 1000;
+    }
+
+    if(state == BENCHMARK_SETTLING && time >= settle_until) {
+        sequence = 0;
+        random_state = 1;
+        burst_remaining = 0;
+        have_pending_frame = false;
+        frames_offered = 0;
+        frames_received = 0;
+        next_due_ns = (uint64_t)time * 1000;
+        last_yield_time = time;
+
+        read_counters(&start_counters, time);
+        state = BENCHMARK_RUNNING;
+    }
+
+    if(state != BENCHMARK_RUNNING)
+        return;
+
+    if(time - start_counters.time >= (int64_t)profile.duration_ms * 1000) {
+        benchmark_counters_t end_counters;
+
+        read_counters(&end_counters, time);
+        state = BENCHMARK_IDLE;
+
+        send_report(&end_counters);
+        finished = true;
+        return;
+    }
+
+    if(profile.source == BENCHMARK_SELF_TEST)
+        transmit_due(time);
+    else
+        pace_injection(time);
+}
+
+/**
+ * @brief PRIVATE Read the run time of both idle tasks, they only accumulate run time while
+ * nothing else wants the core
+ *
+ * @param idle_time microseconds per core
+ * @return true
+ * @return false run time stats are disabled in the sdkconfig
+ */
+static bool read_idle_time(uint32_t idle_time[portNUM_PROCESSORS]) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    for(UBaseType_t core = 0; core < portNUM_PROCESSORS; core++) {
+        TaskStatus_t task_status;
+
+        vTaskGetInfo(xTaskGetIdleTaskHandleForCPU(core), &task_status, pdFALSE, eInvalid);
+        idle_time[core] = task_status.ulRunTimeCounter;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief PRIVATE Snapshot the counters for one end of the run
+ *
+ * @param counters
+ * @param time
+ */
+static void read_counters(benchmark_counters_t* counters, int64_t time) {
+    twai_status_info_t status_info;
+
+    memset(counters, 0, sizeof(benchmark_counters_t));
+    counters->time = time;
+
+    if(twai_get_status_info(&status_info) == ESP_OK) {
+        counters->rx_overrun = status_info.rx_overrun_count;
+        counters->rx_missed = status_info.rx_missed_count;
+    }
+
+    counters->total_drops = backpressure_get_drop_count();
+    counters->queue_drops = comms_get_queue_drop_count();
+    counters->tx_bytes = comms_get_tx_byte_count();
+    counters->idle_valid = read_idle_time(counters->idle_time);
+}
+
+/**
+ * @brief PRIVATE Send a BENCHMARK_REPORT record, it goes out on the telemetry channel so a full
+ * capture queue can't hold it back
+ *
+ * Data: source (1), bitrate (4), load percent (2), duration us (4), frames offered (4),
+ * frames received (4), received frames per second (4), controller overruns (4), driver queue
+ * drops (4), backpressure drops (4), message queue drops (4), core 0 load percent (1),
+ * core 1 load percent (1), uart bytes (4), uart load percent (1), bus overruns (4), bus driver
+ * queue drops (4). Core loads are 0xFF when run time stats are disabled.
+ *
+ * The controller and driver are only part of the pipeline in self test. An inject run bypasses
+ * them, so whatever real bus traffic they drop meanwhile is reported in the separate bus fields
+ * instead of being counted against the pipeline.
+ *
+ * @param end_counters
+ */
+static void send_report(const benchmark_counters_t* end_counters) {
+    uint8_t data[1 + 4 + 2 + 4 * 8 + 2 + 4 + 1 + 4 * 2];
+    size_t len = 0;
+    uint32_t duration_us = (uint32_t)(end_counters->time - start_counters.time);
+    uint32_t queue_drops = end_counters->queue_drops - start_counters.queue_drops;
+    uint32_t tx_bytes = end_counters->tx_bytes - start_counters.tx_bytes;
+    uint32_t rx_overrun = end_counters->rx_overrun - start_counters.rx_overrun;
+    uint32_t rx_missed = end_counters->rx_missed - start_counters.rx_missed;
+    bool controller_in_pipeline = profile.source == BENCHMARK_SELF_TEST;
+
+    data[len++] = (uint8_t)profile.source;
+    len += comms_put_u32(data + len, profile.bitrate);
+    len += comms_put_u16(data + len, profile.load_percent);
+    len += comms_put_u32(data + len, duration_us);
+    len += comms_put_u32(data + len, frames_offered);
+    len += comms_put_u32(data + len, frames_received);
+    len += comms_put_u32(data + len, (uint32_t)((uint64_t)frames_received * 1000000 / duration_us));
+    len += comms_put_u32(data + len, controller_in_pipeline ? rx_overrun : 0);
+    len += comms_put_u32(data + len, controller_in_pipeline ? rx_missed : 0);
+    // Backpressure counts every drop, the queue full ones are split out below
+    len += comms_put_u32(data + len, end_counters->total_drops - start_counters.total_drops - queue_drops);
+    len += comms_put_u32(data + len, queue_drops);
+
+    for(size_t core = 0; core < 2; core++) {
+        uint8_t load = BENCHMARK_CPU_UNAVAILABLE;
+
+        if(core < portNUM_PROCESSORS && start_counters.idle_valid) {
+            uint32_t idle_us = end_counters->idle_time[core] - start_counters.idle_time[core];
+
+            load = idle_us >= duration_us ? 0 : (uint8_t)(100 - (uint64_t)idle_us * 100 / duration_us);
+        }
+
+        data[len++] = load;
+    }
+
+    // 10 bits per byte on the wire with 8N1
+    uint64_t uart_load = (uint64_t)tx_bytes * 10 * 100 * 1000000 / ((uint64_t)comms_get_baud_rate() * duration_us);
+
+    len += comms_put_u32(data + len, tx_bytes);
+    data[len++] = uart_load > 100 ? 100 : (uint8_t)uart_load;
+
+    len += comms_put_u32(data + len, controller_in_pipeline ? 0 : rx_overrun);
+    len += comms_put_u32(data + len, controller_in_pipeline ? 0 : rx_missed);
+
+    can_bus_send_record(BENCHMARK_REPORT, 0, data, len);
+}
@@ -0,0 +1,42 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+#include "defines.h"
+#include "comms.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <driver/twai.h>
+
+// Upload: source (1), bitrate (4), load percent (2), min dlc (1), max dlc (1), id count (2),
+// burst length (2), duration ms (4)
+#define BENCHMARK_UPLOAD_LEN 17
+
+typedef enum benchmark_source_t {
+    BENCHMARK_INJECT = 0,       // Synthetic frames fed straight into the receive pipeline, no bus needed
+    BENCHMARK_SELF_TEST = 1,    // Frames transmitted in no-ack mode and received back through the controller
+    BENCHMARK_SOURCE_COUNT
+} benchmark_source_t;
+
+typedef struct benchmark_profile_t {
+    benchmark_source_t source;
+    uint32_t bitrate;           // Paces the generator, self test also runs the controller at it
+    uint16_t load_percent;      // Offered bus load, 0 is unthrottled (inject only)
+    uint8_t min_dlc;
+    uint8_t max_dlc;
+    uint16_t id_count;          // IDs used, counting up from BENCHMARK_BASE_ID
+    uint16_t burst_len;         // Frames generated back to back before pacing kicks in
+    uint32_t duration_ms;
+} benchmark_profile_t;
+
+esp_err_t benchmark_start(const benchmark_profile_t* profile, comms_status_t* status);
+void benchmark_restore(comms_status_t* status);
+bool benchmark_is_active();
+bool benchmark_is_injecting();
+
+bool benchmark_inject(twai_message_t* message, int64_t time);
+void benchmark_count_frame();
+void benchmark_update(int64_t time);
+
+#endif
@@ -12,8 +12,24 @@
 #include "comms.h"
 #include "can_bus.h"
 #include "ota.h"
+#include "telemetry.h"
+#include "config.h"
+#include "benchmark.h"
 
 TaskHandle_t sniff_handle;
+TaskHandle_t comms_tx_handle; 
+TaskHandle_t comms_rx_handle; 
+
+#ifdef STATIC_MEMORY_PROFILE
+static StackType_t can_bus_task_stack[CAN_BUS_TASK_STACK_SIZE]; 
+static StaticTask_t can_bus_task_buffer; 
+static StackType_t comms_tx_task_stack[COMMS_TX_TASK_STACK_SIZE]; 
+static StaticTask_t comms_tx_task_buffer; 
+static StackType_t comms_rx_task_stack[COMMS_RX_TASK_STACK_SIZE]; 
+static StaticTask_t comms_rx_task_buffer; 
+
+static char comms_rx_buffer[RX_BUF_SIZE + 1]; 
+#endif
 
 can_config_t can_bus_config = { 
     .g_config = default_g_config, 
@@ -23,6 +39,7 @@ can_config_t can_bus_config = {
 
 comms_status_t prog_status = {
     .sniff = false,
+    .bitrate = CAN_BUS_DEFAULT_BITRATE,
     .current_config = {
         .g_config = default_g_config, 
         .t_config = default_t_config, 
@@ -32,26 +49,59 @@ comms_status_t prog_status = {
 
 void init(void) {
     ESP_ERROR_CHECK(comms_init()); 
+    ESP_ERROR_CHECK(can_bus_records_init()); 
     ESP_ERROR_CHECK(ota_do_after_update());
 
     //clear_screen();
 }
 
+/**
+ * @brief Hold a task until app_main has registered every task for telemetry, so a telemetry 
+ * request never reads a partially filled task table
+ * 
+ */
+static void wait_for_start() { 
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY); 
+}
+
 static void can_bus_task(void *arg) { 
+    wait_for_start(); 
+
     // ESP_ERROR_CHECK(can_bus_init(can_bus_config)); 
     while(1) {
+        // Put the sniff state and CAN configuration back once a benchmark run has reported
+        benchmark_restore(&prog_status); 
+
+        if(prog_status.reconfigure) { 
+            // Stop the driver, it is started again below with the new configuration. Mid bus-off 
+            // recovery it stays installed, so the request is kept until the recovery is done
+            esp_err_t err = can_bus_cleanup(); 
+
+            if(err == ESP_ERR_NOT_FINISHED) { 
+                vTaskDelay(10 / portTICK_PERIOD_MS); 
+                continue; 
+            }
+
+            ESP_ERROR_CHECK(err); 
+            prog_status.reconfigure = false; 
+        }
 
         if(!prog_status.sniff)
         {
-            ESP_ERROR_CHECK(can_bus_cleanup()); 
+            // A recovery in progress is left to finish, cleanup is retried on the next loop
+            esp_err_t err = can_bus_cleanup(); 
+
+            if(err != ESP_ERR_NOT_FINISHED)
+                ESP_ERROR_CHECK(err); 
+
+            vTaskDelay(10 / portTICK_PERIOD_MS);
         } else { 
             can_bus_config = prog_status.current_config; 
             
+            // No delay here, twai_receive blocks until a frame arrives
             ESP_ERROR_CHECK(can_bus_init(can_bus_config)); 
             ESP_ERROR_CHECK(can_bus_update());
         }
-
-        vTaskDelay(10 / portTICK_PERIOD_MS);
     }
 
     ESP_ERROR_CHECK(can_bus_cleanup()); 
@@ -59,16 +109,24 @@ static void can_bus_task(void *arg) {
 
 static void comms_tx_task(void *arg)
 {
+    wait_for_start(); 
+
     while (1) {
+        // Blocks until the CAN task queues a message
         comms_update_tx(); 
-        
-        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
 }
 
 static void comms_rx_task(void *arg)
 {
+    wait_for_start(); 
+
+#ifdef STATIC_MEMORY_PROFILE
+    char* data = comms_rx_buffer; 
+#else
     char* data = (char*) malloc(RX_BUF_SIZE + 1); //Allocate a recieve buffer for the max buffer size plus null
+    assert(data != NULL); 
+#endif
     memset(data, 0, RX_BUF_SIZE + 1); // Clear the data 
 
     while (1) {
@@ -77,21 +135,55 @@ static void comms_rx_task(void *arg)
         memset(data, 0, filledSize); 
     }
 
+#ifndef STATIC_MEMORY_PROFILE
     free(data);
+#endif
 }
 
 void app_main(void)
 {
-    nvs_flash_init(); 
+    esp_err_t err = nvs_flash_init(); 
+
+    if(err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) { 
+        ESP_ERROR_CHECK(nvs_flash_erase()); 
+        err = nvs_flash_init(); 
+    }
+
+    // Apply the stored configuration before anything starts, with auto start set the CAN task 
+    // goes straight into capture
+    stored_config_t stored_config; 
+    bool stored_config_invalid = err == ESP_OK && config_load(&stored_config) == ESP_OK && 
+        config_apply(&stored_config, &prog_status) != ESP_OK; 
 
     init(); 
 
-    xTaskCreatePinnedToCore(can_bus_task, "canbus", 1024*2, NULL, configMAX_PRIORITIES, &sniff_handle, 1); 
-    xTaskCreatePinnedToCore(comms_tx_task, "uart_tx_task", 2048*2, NULL, configMAX_PRIORITIES-1, NULL, 0);
-    xTaskCreatePinnedToCore(comms_rx_task, "uart_rx_task", 2048*2, NULL, configMAX_PRIORITIES-2, NULL, 0);
+    // Logged once comms is up so it goes out framed on the log channel
+    if(stored_config_invalid)
+        ESP_LOGE("MAIN", "Stored configuration is invalid, using defaults"); 
+
+    // CAN receive on core 1 feeds the UART transmit on core 0, the host command task 
+    // shares core 0 below the transmit task so it never delays outgoing data 
+#ifdef STATIC_MEMORY_PROFILE
+    sniff_handle = xTaskCreateStaticPinnedToCore(can_bus_task, "canbus", CAN_BUS_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-1, can_bus_task_stack, &can_bus_task_buffer, 1); 
+    comms_tx_handle = xTaskCreateStaticPinnedToCore(comms_tx_task, "uart_tx_task", COMMS_TX_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-2, comms_tx_task_stack, &comms_tx_task_buffer, 0);
+    comms_rx_handle = xTaskCreateStaticPinnedToCore(comms_rx_task, "uart_rx_task", COMMS_RX_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-3, comms_rx_task_stack, &comms_rx_task_buffer, 0);
+#else
+    xTaskCreatePinnedToCore(can_bus_task, "canbus", CAN_BUS_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-1, &sniff_handle, 1); 
+    xTaskCreatePinnedToCore(comms_tx_task, "uart_tx_task", COMMS_TX_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-2, &comms_tx_handle, 0);
+    xTaskCreatePinnedToCore(comms_rx_task, "uart_rx_task", COMMS_RX_TASK_STACK_SIZE, NULL, configMAX_PRIORITIES-3, &comms_rx_handle, 0);
+#endif
+
+    ESP_ERROR_CHECK(telemetry_register_task(sniff_handle)); 
+    ESP_ERROR_CHECK(telemetry_register_task(comms_tx_handle)); 
+    ESP_ERROR_CHECK(telemetry_register_task(comms_rx_handle)); 
+
+    // Release the tasks now the task table is complete
+    xTaskNotifyGive(sniff_handle); 
+    xTaskNotifyGive(comms_tx_handle); 
+    xTaskNotifyGive(comms_rx_handle); 
 
     vTaskDelay(10 / portTICK_PERIOD_MS);
 
-    printf("\n");
-    printf("READY\n");
+    uint8_t running_update = ota_is_running_update(); 
+    ESP_ERROR_CHECK(comms_send_control(CONTROL_READY, &running_update, sizeof(running_update))); 
 }
\ No newline at end of file
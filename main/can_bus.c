@@ -1,17 +1,135 @@
 #include "can_bus.h"
 #include "comms.h"
+#include "backpressure.h"
+#include "isotp.h"
+#include "pid_poll.h"
+#include "benchmark.h"
 #include "esp_timer.h"
 #include <string.h>
 #include <lwip/sockets.h>
 
 /// Private variables
 int64_t microsecond_time; 
-int64_t last_microsecond_time; 
+// Record times are deltas within a channel, the host accumulates every channel separately
+int64_t last_microsecond_time[COMMS_CHANNEL_COUNT]; 
 
 esp_err_t last_err; 
 
+// Boot timing, microseconds since boot
+int64_t first_start_time = 0; 
+bool first_frame_seen = false; 
+
+// Alerts read since the last BUS_EVENT record
+uint32_t pending_alerts = 0; 
+int64_t last_event_time = 0; 
+
+// Serializes the record time deltas with the order records are queued in
+SemaphoreHandle_t record_lock = NULL; 
+
+#ifdef STATIC_MEMORY_PROFILE
+static StaticSemaphore_t record_lock_buffer; 
+#endif
+
 /// Private function pre declarations
-esp_err_t generate_message(comms_message_t *message, uint32_t time, can_message_type message_type, uint32_t id, void* data, size_t data_len); 
+void check_alerts(int64_t time); 
+void send_bus_event(can_bus_event_reason reason, uint32_t alerts, const twai_status_info_t* status_info); 
+esp_err_t generate_message(comms_message_t *message, comms_channel channel, uint32_t time, can_message_type message_type, uint32_t id, void* data, size_t data_len); 
+
+/**
+ * @brief Initialize the record lock, must be called once before any task sends records
+ * 
+ * @return esp_err_t 
+ */
+esp_err_t can_bus_records_init() { 
+#ifdef STATIC_MEMORY_PROFILE
+    record_lock = xSemaphoreCreateMutexStatic(&record_lock_buffer); 
+#else
+    record_lock = xSemaphoreCreateMutex(); 
+#endif
+
+    return record_lock == NULL ? ESP_ERR_NO_MEM : ESP_OK; 
+}
+
+/**
+ * @brief PRIVATE Get the UART channel a record type is sent on
+ * 
+ * @param type 
+ * @return comms_channel 
+ */
+HOT_PATH_ATTR static comms_channel record_channel(can_message_type type) { 
+    switch(type) { 
+        // Overload and drop records go here as well, out of reach of capture queue evictions
+        case TELEMETRY: 
+        case BENCHMARK_REPORT: 
+        case OVERLOAD_EVENT: 
+        case DROP_REPORT: 
+            return COMMS_CHANNEL_TELEMETRY; 
+        default: 
+            return COMMS_CHANNEL_CAPTURE; 
+    }
+}
+
+/**
+ * @brief Queue a record for the host, safe to call from any task. 
+ * 
+ * The record time is the microseconds since the previous record on the same channel. 
+ * 
+ * @param type 
+ * @param id 
+ * @param data 
+ * @param data_len 
+ * @return esp_err_t 
+ */
+HOT_PATH_ATTR esp_err_t can_bus_send_record(can_message_type type, uint32_t id, void* data, size_t data_len) { 
+    comms_message_t com_message; 
+    comms_channel channel = record_channel(type); 
+    esp_err_t err; 
+
+    xSemaphoreTake(record_lock, portMAX_DELAY); 
+
+    microsecond_time = esp_timer_get_time(); 
+    err = generate_message(&com_message, channel, microsecond_time - last_microsecond_time[channel], type, id, data, data_len); 
+
+    // A dropped record's delta is folded into the next one, so the host clock never skips it
+    if(err == ESP_OK && add_message(&com_message))
+        last_microsecond_time[channel] = microsecond_time; 
+
+    xSemaphoreGive(record_lock); 
+
+    return err; 
+}
+
+/**
+ * @brief Get the timing configuration for one of the TWAI bitrate presets
+ * 
+ * @param bitrate bits per second
+ * @param t_config 
+ * @return esp_err_t ESP_ERR_NOT_SUPPORTED if there is no preset for the bitrate
+ */
+esp_err_t can_bus_timing_for_bitrate(uint32_t bitrate, twai_timing_config_t* t_config) { 
+    static const twai_timing_config_t timing_25k = TWAI_TIMING_CONFIG_25KBITS(); 
+    static const twai_timing_config_t timing_50k = TWAI_TIMING_CONFIG_50KBITS(); 
+    static const twai_timing_config_t timing_100k = TWAI_TIMING_CONFIG_100KBITS(); 
+    static const twai_timing_config_t timing_125k = TWAI_TIMING_CONFIG_125KBITS(); 
+    static const twai_timing_config_t timing_250k = TWAI_TIMING_CONFIG_250KBITS(); 
+    static const twai_timing_config_t timing_500k = TWAI_TIMING_CONFIG_500KBITS(); 
+    static const twai_timing_config_t timing_800k = TWAI_TIMING_CONFIG_800KBITS(); 
+    static const twai_timing_config_t timing_1m = TWAI_TIMING_CONFIG_1MBITS(); 
+
+    switch(bitrate) { 
+        case 25000: *t_config = timing_25k; break; 
+        case 50000: *t_config = timing_50k; break; 
+        case 100000: *t_config = timing_100k; break; 
+        case 125000: *t_config = timing_125k; break; 
+        case 250000: *t_config = timing_250k; break; 
+        case 500000: *t_config = timing_500k; break; 
+        case 800000: *t_config = timing_800k; break; 
+        case 1000000: *t_config = timing_1m; break; 
+        default: return ESP_ERR_NOT_SUPPORTED; 
+    }
+
+    return ESP_OK; 
+}
 
 /**
  * @brief Initialize the CAN Bus driver
@@ -30,9 +148,17 @@ esp_err_t can_bus_init(can_config_t settings) {
     esp_log_level_set(TAG, ESP_LOG_NONE);
 #endif
     
-    //Get the current twai state return if something went wrong or already running
+    //Get the current twai state, if the driver is already installed only restart it when a 
+    //bus-off recovery left it stopped
     last_err = twai_get_status_info(&status_info); 
-    if((last_err != ESP_OK && last_err != ESP_ERR_INVALID_STATE) || status_info.state == TWAI_STATE_RUNNING) 
+    if(last_err == ESP_OK) { 
+        if(status_info.state == TWAI_STATE_STOPPED)
+            last_err = twai_start(); 
+
+        return last_err; 
+    }
+
+    if(last_err != ESP_ERR_INVALID_STATE)
         return last_err; 
         
     //Install the driver based on the current provided configuration
@@ -45,9 +171,15 @@ esp_err_t can_bus_init(can_config_t settings) {
 
     ESP_LOGI(TAG, "Driver started");
 
+    if(first_start_time == 0)
+        first_start_time = esp_timer_get_time(); 
+
     //Initialize our time variables
     microsecond_time = 0; 
-    last_microsecond_time = 0; 
+    memset(last_microsecond_time, 0, sizeof(last_microsecond_time)); 
+
+    pending_alerts = 0; 
+    last_event_time = 0; 
 
     return last_err; 
 }
@@ -57,20 +189,56 @@ esp_err_t can_bus_init(can_config_t settings) {
  * 
  * @return esp_err_t 
  */
-esp_err_t can_bus_update() {
+HOT_PATH_ATTR esp_err_t can_bus_update() {
     twai_message_t message;     
-    comms_message_t com_message;
+
+    bool received; 
 
     last_err = ESP_OK; 
 
-    if(!(last_err = twai_receive(&message, CAN_TICKS_TO_WAIT) == ESP_OK)) {
+    // An inject benchmark feeds synthetic frames in place of the controller, while polling or 
+    // running a self test wake up every tick so requests and test frames go out on time
+    if(benchmark_is_injecting())
+        received = benchmark_inject(&message, esp_timer_get_time()); 
+    else
+        received = twai_receive(&message, pid_poll_is_active() || benchmark_is_active() ? 1 : CAN_TICKS_TO_WAIT) == ESP_OK; 
+
+    if(!received) {
+        int64_t idle_time = esp_timer_get_time(); 
+
+        check_alerts(idle_time); 
+        pid_poll_update(idle_time); 
+        isotp_update(idle_time); 
+        backpressure_update(idle_time); 
+        benchmark_update(idle_time); 
         return ESP_OK; 
     }
 
-    microsecond_time = esp_timer_get_time(); 
-    last_err = generate_message(&com_message, microsecond_time - last_microsecond_time, message.rtr ? REMOTE_FRAME : STANDARD_FRAME, message.identifier, message.data, message.data_length_code); 
-    add_message(&com_message); 
-    last_microsecond_time = microsecond_time; 
+    int64_t receive_time = esp_timer_get_time(); 
+
+    benchmark_count_frame(); 
+
+    if(!first_frame_seen) { 
+        // Data: driver started (4), first frame (4), both in microseconds since boot
+        uint32_t net_times[2] = { htonl((uint32_t)first_start_time), htonl((uint32_t)receive_time) }; 
+
+        first_frame_seen = true; 
+        can_bus_send_record(BOOT_TIMING, 0, net_times, sizeof(net_times)); 
+    }
+
+    // Responses to polled PIDs are sent as one result record, frames that are part of an 
+    // ISO-TP sequence are sent as one PDU record once complete
+    if(!pid_poll_process(&message, receive_time) && !isotp_process(&message, receive_time) && 
+            backpressure_admit(&message, receive_time))
+        last_err = can_bus_send_record(message.rtr ? REMOTE_FRAME : STANDARD_FRAME, message.identifier, message.data, message.data_length_code); 
+
+    check_alerts(receive_time); 
+
+    // Issue the next request as soon as a response frees up its ECU
+    pid_poll_update(receive_time); 
+    isotp_update(receive_time); 
+    backpressure_update(receive_time); 
+    benchmark_update(receive_time); 
 
     return last_err; 
 }
@@ -78,7 +246,8 @@ esp_err_t can_bus_update() {
 /**
  * @brief Cleanup the CAN bus driver
  * 
- * @return esp_err_t Error response
+ * @return esp_err_t Error response, ESP_ERR_NOT_FINISHED if a bus-off recovery is in progress 
+ * and the driver is still installed
  */
 esp_err_t can_bus_cleanup() { 
     twai_status_info_t status_info; 
@@ -90,13 +259,23 @@ esp_err_t can_bus_cleanup() {
     if(last_err == ESP_ERR_INVALID_STATE)
         return ESP_OK; 
     
-    if(last_err != ESP_OK || status_info.state == TWAI_STATE_STOPPED)
+    if(last_err != ESP_OK)
         return last_err; 
 
-    //Stop and uninstall TWAI driver
-    last_err = twai_stop();
+    //The driver can't be uninstalled mid recovery, try again on the next call
+    if(status_info.state == TWAI_STATE_RECOVERING)
+        return ESP_ERR_NOT_FINISHED; 
+
+    //Report the final error counters so the host can close out the capture
+    send_bus_event(BUS_EVENT_STOPPED, pending_alerts, &status_info); 
+    pending_alerts = 0; 
+
+    //Stop and uninstall TWAI driver, bus-off and recovered drivers are already stopped
+    if(status_info.state == TWAI_STATE_RUNNING) { 
+        last_err = twai_stop();
     
-    ESP_LOGI(TAG, "Driver stopped");
+        ESP_LOGI(TAG, "Driver stopped");
+    }
     
     // send_data(CAN_DRIVER_STOPPED);
     last_err = twai_driver_uninstall();
@@ -107,10 +286,95 @@ esp_err_t can_bus_cleanup() {
     return last_err; 
 }
 
+/**
+ * @brief PRIVATE Read the TWAI alerts, recover from bus-off and send BUS_EVENT records. 
+ * 
+ * State changes are sent right away, anything else (bus errors, arbitration lost, overruns) is 
+ * accumulated and sent at most once every CAN_BUS_EVENT_INTERVAL_MS so a noisy bus can't flood 
+ * the stream. 
+ * 
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR void check_alerts(int64_t time) { 
+    uint32_t alerts = 0; 
+    twai_status_info_t status_info; 
+
+    if(twai_read_alerts(&alerts, 0) != ESP_OK)
+        alerts = 0; 
+
+    pending_alerts |= alerts; 
+
+    if(pending_alerts == 0)
+        return; 
+
+    if(alerts & TWAI_ALERT_BUS_OFF) { 
+        ESP_LOGE(TAG, "Bus off, starting recovery"); 
+        twai_initiate_recovery(); 
+    }
+
+    if(alerts & TWAI_ALERT_BUS_RECOVERED) { 
+        ESP_LOGI(TAG, "Bus recovered"); 
+        twai_start(); 
+    }
+
+    if(!(pending_alerts & CAN_BUS_STATE_ALERTS) && time - last_event_time < CAN_BUS_EVENT_INTERVAL_MS * 1000)
+        return; 
+
+    if(twai_get_status_info(&status_info) != ESP_OK)
+        return; 
+
+    send_bus_event(BUS_EVENT_ALERT, pending_alerts, &status_info); 
+
+    pending_alerts = 0; 
+    last_event_time = time; 
+}
+
+/**
+ * @brief PRIVATE Send a BUS_EVENT record
+ * 
+ * Data: reason (1), alerts (4), state (1), tec (2), rec (2), bus errors (4), rx missed (4), 
+ * rx overrun (4), arbitration lost (4), tx failed (4)
+ * 
+ * @param reason 
+ * @param alerts TWAI_ALERT_* bits seen since the last record
+ * @param status_info 
+ */
+void send_bus_event(can_bus_event_reason reason, uint32_t alerts, const twai_status_info_t* status_info) { 
+    uint8_t data[30]; 
+    size_t len = 0; 
+    uint16_t net_u16; 
+    uint32_t net_u32; 
+
+    data[len++] = (uint8_t)reason; 
+    net_u32 = htonl(alerts); 
+    memcpy(data + len, &net_u32, sizeof(uint32_t)); len += sizeof(uint32_t); 
+    data[len++] = (uint8_t)status_info->state; 
+    net_u16 = htons((uint16_t)status_info->tx_error_counter); 
+    memcpy(data + len, &net_u16, sizeof(uint16_t)); len += sizeof(uint16_t); 
+    net_u16 = htons((uint16_t)status_info->rx_error_counter); 
+    memcpy(data + len, &net_u16, sizeof(uint16_t)); len += sizeof(uint16_t); 
+
+    const uint32_t counters[] = { 
+        status_info->bus_error_count, 
+        status_info->rx_missed_count, 
+        status_info->rx_overrun_count, 
+        status_info->arb_lost_count, 
+        status_info->tx_failed_count
+    }; 
+
+    for(size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) { 
+        net_u32 = htonl(counters[i]); 
+        memcpy(data + len, &net_u32, sizeof(uint32_t)); len += sizeof(uint32_t); 
+    }
+
+    can_bus_send_record(BUS_EVENT, 0, data, len); 
+}
+
 /**
  * @brief Generate a comms message from CAN_BUS data
  * 
  * @param message 
+ * @param channel 
  * @param time 
  * @param message_type 
  * @param id 
@@ -118,7 +382,7 @@ esp_err_t can_bus_cleanup() {
  * @param data_len 
  * @return esp_err_t 
  */
-esp_err_t generate_message(comms_message_t *message, uint32_t time, can_message_type message_type, uint32_t id, void* data, size_t data_len) { 
+HOT_PATH_ATTR esp_err_t generate_message(comms_message_t *message, comms_channel channel, uint32_t time, can_message_type message_type, uint32_t id, void* data, size_t data_len) { 
     //NOTE: This could be done with a few memcpy's however I think by unrolling the loop and bitwise shifting its actually slightly faster
 
     // Translate the message type and convert it to a byte array
@@ -139,15 +403,14 @@ esp_err_t generate_message(comms_message_t *message, uint32_t time, can_message_
     long net_time = htonl(time); 
     memcpy(time_arr, &net_time, time_arr_len); 
 
-    size_t message_data_arr_len = type_arr_len + id_arr_len + time_arr_len + data_len; 
-    uint8_t message_data_arr[message_data_arr_len]; 
-    memset(message_data_arr, 0, message_data_arr_len);
+    // Only the header is built here, the data is copied straight into the message so large 
+    // records (ISO-TP PDUs) never land on the stack
+    size_t header_arr_len = type_arr_len + id_arr_len + time_arr_len; 
+    uint8_t header_arr[header_arr_len]; 
 
-    memcpy(message_data_arr, time_arr, time_arr_len);
-    memcpy(message_data_arr + time_arr_len, type_arr, type_arr_len);  
-    memcpy(message_data_arr + time_arr_len + type_arr_len, id_arr, id_arr_len); 
-    memcpy(message_data_arr + time_arr_len + type_arr_len + id_arr_len, data, data_len); 
+    memcpy(header_arr, time_arr, time_arr_len);
+    memcpy(header_arr + time_arr_len, type_arr, type_arr_len);  
+    memcpy(header_arr + time_arr_len + type_arr_len, id_arr, id_arr_len); 
     
-    // printf("create_message(message, message_data_arr, %d);\n", message_data_arr_len);
-    return create_message(message, message_data_arr, message_data_arr_len); 
+    return create_record_message(message, channel, header_arr, header_arr_len, data, data_len); 
 }
@@ -12,6 +12,7 @@
 #include <freertos/semphr.h> 
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_intr_alloc.h>
 #include <driver/gpio.h> 
 #include <driver/twai.h>
 
@@ -19,9 +20,36 @@
 
 typedef enum can_message_type { 
     STANDARD_FRAME = 0, 
-    REMOTE_FRAME = 1
+    REMOTE_FRAME = 1,
+    OVERLOAD_EVENT = 2,     // Backpressure state or policy change
+    DROP_REPORT = 3,        // Messages dropped since the last report
+    ID_SUMMARY = 4,         // Frames of one ID folded into a summary while overloaded
+    TELEMETRY = 5,          // Heap and task stack usage
+    ISOTP_PDU = 6,          // Reassembled ISO-TP PDU
+    ISOTP_ERROR = 7,        // ISO-TP sequence error, timeout or overflow
+    PID_RESULT = 8,         // Response (or timeout) to a device polled PID
+    BUS_EVENT = 9,          // TWAI alerts and error counters
+    BOOT_TIMING = 10,       // Boot to first frame timing, sent once per boot
+    BENCHMARK_REPORT = 11   // Throughput and drops by stage for a benchmark run
 } can_message_type; 
 
+typedef enum can_bus_event_reason { 
+    BUS_EVENT_ALERT = 0, 
+    BUS_EVENT_STOPPED = 1
+} can_bus_event_reason; 
+
+// Alerts that are reported as bus health events, the per frame RX / TX alerts are left out
+#define CAN_BUS_HEALTH_ALERTS (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_RECOVERY_IN_PROGRESS | \
+    TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_ARB_LOST | TWAI_ALERT_ABOVE_ERR_WARN | \
+    TWAI_ALERT_BELOW_ERR_WARN | TWAI_ALERT_BUS_ERROR | TWAI_ALERT_TX_FAILED | \
+    TWAI_ALERT_RX_QUEUE_FULL | TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF | \
+    TWAI_ALERT_RX_FIFO_OVERRUN)
+
+// Alerts that change the controller state, these are reported immediately
+#define CAN_BUS_STATE_ALERTS (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_RECOVERY_IN_PROGRESS | \
+    TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_BELOW_ERR_WARN | \
+    TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF)
+
 typedef struct can_config_t { 
     twai_general_config_t g_config; 
     twai_timing_config_t t_config; 
@@ -36,13 +64,24 @@ static const twai_general_config_t default_g_config = {
     .bus_off_io = TWAI_IO_UNUSED,
     .rx_queue_len = 10, 
     .tx_queue_len = 10, 
-    .alerts_enabled = TWAI_ALERT_ALL, 
-    .clkout_divider = 0
+    .alerts_enabled = CAN_BUS_HEALTH_ALERTS, 
+    .clkout_divider = 0,
+#ifdef CONFIG_TWAI_ISR_IN_IRAM
+    .intr_flags = ESP_INTR_FLAG_IRAM
+#else
+    .intr_flags = ESP_INTR_FLAG_LEVEL1
+#endif
 };
 
+#define CAN_BUS_DEFAULT_BITRATE 500000
 static const twai_timing_config_t default_t_config = TWAI_TIMING_CONFIG_500KBITS(); 
 static const twai_filter_config_t default_f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL(); 
 
+esp_err_t can_bus_records_init(); 
+esp_err_t can_bus_send_record(can_message_type type, uint32_t id, void* data, size_t data_len); 
+
+esp_err_t can_bus_timing_for_bitrate(uint32_t bitrate, twai_timing_config_t* t_config); 
+
 esp_err_t can_bus_init(can_config_t setting); 
 esp_err_t can_bus_update(); 
 esp_err_t can_bus_cleanup(); 
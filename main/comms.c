@@ -1,6 +1,8 @@
 #include "comms.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 
 #include <esp_log.h>
@@ -10,6 +12,9 @@
 #include <esp_intr_alloc.h>
 #include <lwip/sockets.h>
 #include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/ringbuf.h>
+#include <freertos/semphr.h>
 
 
 #if CONFIG_IDF_TARGET_ESP32
@@ -19,6 +24,12 @@
 #endif
 
 #include "ota.h"
+#include "backpressure.h"
+#include "telemetry.h"
+#include "isotp.h"
+#include "pid_poll.h"
+#include "config.h"
+#include "benchmark.h"
 
 int send_string(char* data); 
 int send_formatted_data(uint8_t* data, size_t len); 
@@ -26,14 +37,83 @@ int send_data_with_length(uint8_t* data, size_t len);
 
 bool comms_initialized = false; 
 
-typedef struct comms_message_queue_t { 
-    comms_message_t* messages; 
-    size_t count; 
-} comms_message_queue_t; 
+// Messages are handed to the transmit task through one no-split ring buffer per channel, the 
+// capture channel's is the message queue. Every queued message notifies the transmit task so it
+// wakes the moment anything is ready. 
+RingbufHandle_t message_queue = NULL; 
+RingbufHandle_t channel_queues[COMMS_CHANNEL_COUNT]; 
+TaskHandle_t tx_task = NULL; 
+
+// Bytes each channel queue holds, including the ring buffer item headers. The ring buffer itself 
+// only reports its largest contiguous free region, which never drops below half of an empty 
+// no-split buffer, so the fill level is tracked here instead. 
+static portMUX_TYPE queued_lock = portMUX_INITIALIZER_UNLOCKED; 
+static size_t queued_bytes[COMMS_CHANNEL_COUNT]; 
+
+// Summed time deltas of evicted capture records, added to the next capture record that goes out 
+// so the host's running clock doesn't fall behind. The read lock keeps evictions and the 
+// transmit task taking records off the capture queue in one order. 
+static SemaphoreHandle_t capture_read_lock = NULL; 
+static uint32_t evicted_time = 0; 
+
+static const size_t channel_queue_sizes[COMMS_CHANNEL_COUNT] = { 
+    COMMS_CONTROL_QUEUE_SIZE, 
+    COMMS_TELEMETRY_QUEUE_SIZE, 
+    COMMS_LOG_QUEUE_SIZE, 
+    MESSAGE_QUEUE_SIZE
+}; 
+
+#ifdef STATIC_MEMORY_PROFILE
+// No-split ring buffer storage must be 32 bit aligned
+static uint8_t control_queue_storage[COMMS_CONTROL_QUEUE_SIZE] __attribute__((aligned(4))); 
+static uint8_t telemetry_queue_storage[COMMS_TELEMETRY_QUEUE_SIZE] __attribute__((aligned(4))); 
+static uint8_t log_queue_storage[COMMS_LOG_QUEUE_SIZE] __attribute__((aligned(4))); 
+static uint8_t message_queue_storage[MESSAGE_QUEUE_SIZE] __attribute__((aligned(4))); 
+static StaticRingbuffer_t channel_queue_buffers[COMMS_CHANNEL_COUNT]; 
+
+static uint8_t* const channel_queue_storage[COMMS_CHANNEL_COUNT] = { 
+    control_queue_storage, 
+    telemetry_queue_storage, 
+    log_queue_storage, 
+    message_queue_storage
+}; 
+
+// Messages are built here instead of on the heap, only ever used under the record lock
+static uint8_t message_scratch[COMMS_MESSAGE_MAX_LEN]; 
+
+static uint8_t update_buffer_storage[RX_BUF_SIZE]; 
+
+static StaticSemaphore_t capture_read_lock_buffer; 
+#endif
+
+// TX coalescing state
+size_t tx_flush_bytes = COMMS_TX_FLUSH_BYTES; 
+uint32_t tx_flush_us = COMMS_TX_FLUSH_US; 
+
+comms_output_mode output_mode = OUTPUT_MODE_HEX; 
+uint32_t baud_rate = COMMS_DEFAULT_BAUD_RATE; 
+
+// Benchmark counters, messages that didn't fit the queue and bytes written to the UART
+uint32_t queue_drop_count = 0; 
+uint32_t tx_byte_count = 0; 
+
+// Log channel rate cap, a token bucket in bytes shared by every task that logs
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED; 
+static int32_t log_tokens = COMMS_LOG_BURST_BYTES; 
+static int64_t log_refill_time = 0; 
+static uint32_t log_drop_count = 0; 
+
+char tx_chunk[COMMS_TX_CHUNK_SIZE]; 
+size_t tx_chunk_len = 0; 
 
-comms_message_queue_t message_queue; 
+static const char hex_digits[] = "0123456789ABCDEF"; 
 
 uint16_t calculate_crc16(uint8_t* data, size_t len);
+uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t len);
+size_t seal_frame(uint8_t* dst, comms_channel channel, uint32_t len); 
+
+static int log_vprintf(const char* format, va_list args); 
+static void count_queued(comms_channel channel, size_t item_size, bool added); 
 
 /**
  * @brief Initialize the communications over USB via UART
@@ -44,13 +124,31 @@ esp_err_t comms_init() {
 
     esp_log_level_set("*", CONFIG_LOG_MAXIMUM_LEVEL);
 
-    //Allocate the message queue
-    message_queue.messages = (comms_message_t*)malloc(sizeof(comms_message_t) * MESSAGE_QUEUE_LEN); 
-    memset(message_queue.messages, 0, sizeof(comms_message_t) * MESSAGE_QUEUE_LEN);
-    message_queue.count = 0; 
+    //Allocate the channel queues
+    for(size_t i = 0; i < COMMS_CHANNEL_COUNT; i++) { 
+#ifdef STATIC_MEMORY_PROFILE
+        channel_queues[i] = xRingbufferCreateStatic(channel_queue_sizes[i], RINGBUF_TYPE_NOSPLIT, channel_queue_storage[i], &channel_queue_buffers[i]); 
+#else
+        channel_queues[i] = xRingbufferCreate(channel_queue_sizes[i], RINGBUF_TYPE_NOSPLIT); 
+#endif
+
+        if(channel_queues[i] == NULL) 
+            return ESP_ERR_NO_MEM; 
+    }
+
+    message_queue = channel_queues[COMMS_CHANNEL_CAPTURE]; 
+
+#ifdef STATIC_MEMORY_PROFILE
+    capture_read_lock = xSemaphoreCreateMutexStatic(&capture_read_lock_buffer); 
+#else
+    capture_read_lock = xSemaphoreCreateMutex(); 
+#endif
+
+    if(capture_read_lock == NULL)
+        return ESP_ERR_NO_MEM; 
 
     const uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = baud_rate,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -69,24 +167,271 @@ esp_err_t comms_init() {
 
     comms_initialized = last_err == ESP_OK; 
 
+    // From here on log lines go out framed on the log channel instead of straight to the UART
+    if(comms_initialized)
+        esp_log_set_vprintf(log_vprintf); 
+
     return last_err; 
 }
 
 /**
- * @brief Update method for the transmit task
+ * @brief PRIVATE Write out everything in the TX chunk
  * 
  */
+void tx_chunk_flush() { 
+    send_data_with_length((uint8_t*)tx_chunk, tx_chunk_len); 
+    tx_chunk_len = 0; 
+}
+
+/**
+ * @brief PRIVATE Append raw characters to the TX chunk, flushing it when it fills up
+ * 
+ * @param data 
+ * @param len 
+ */
+void tx_chunk_append(const char* data, size_t len) { 
+    for(size_t i = 0; i < len; i++) { 
+        if(tx_chunk_len == COMMS_TX_CHUNK_SIZE)
+            tx_chunk_flush(); 
+
+        tx_chunk[tx_chunk_len++] = data[i]; 
+    }
+}
+
+/**
+ * @brief PRIVATE Append data to the TX chunk as ASCII hex, flushing it when it fills up
+ * 
+ * @param data 
+ * @param len 
+ */
+void tx_chunk_append_hex(const uint8_t* data, size_t len) { 
+    for(size_t i = 0; i < len; i++) { 
+        if(tx_chunk_len + 2 > COMMS_TX_CHUNK_SIZE)
+            tx_chunk_flush(); 
+
+        tx_chunk[tx_chunk_len++] = hex_digits[data[i] >> 4]; 
+        tx_chunk[tx_chunk_len++] = hex_digits[data[i] & 0x0F]; 
+    }
+}
+
+/**
+ * @brief PRIVATE Get the number of ticks to wait until the deadline, rounded down so we 
+ * never wait past it. 
+ * 
+ * @param deadline esp_timer time in microseconds
+ * @return TickType_t 
+ */
+TickType_t ticks_until(int64_t deadline) { 
+    int64_t remaining = deadline - esp_timer_get_time(); 
+
+    if(remaining <= 0)
+        return 0; 
+
+    return (TickType_t)((remaining * configTICK_RATE_HZ) / 1000000); 
+}
+
+/**
+ * @brief PRIVATE Get the time delta of a queued record
+ * 
+ * @param item framed record
+ * @return uint32_t 
+ */
+static uint32_t record_time(const uint8_t* item) { 
+    uint32_t net_time; 
+
+    memcpy(&net_time, item + COMMS_FRAME_HEADER_LEN, sizeof(uint32_t)); 
+
+    return ntohl(net_time); 
+}
+
+/**
+ * @brief PRIVATE Take the next capture record, the time of any records evicted ahead of it is 
+ * added to its own delta and the frame resealed
+ * 
+ * @param item_size 
+ * @return uint8_t* NULL if the capture queue is empty
+ */
+static uint8_t* receive_capture_message(size_t* item_size) { 
+    xSemaphoreTake(capture_read_lock, portMAX_DELAY); 
+
+    uint8_t* item = (uint8_t*)xRingbufferReceive(message_queue, item_size, 0); 
+
+    if(item != NULL && evicted_time != 0 && *item_size >= COMMS_FRAME_OVERHEAD + sizeof(uint32_t)) { 
+        uint32_t net_time = htonl(record_time(item) + evicted_time); 
+
+        memcpy(item + COMMS_FRAME_HEADER_LEN, &net_time, sizeof(uint32_t)); 
+        seal_frame(item, COMMS_CHANNEL_CAPTURE, *item_size - COMMS_FRAME_OVERHEAD); 
+        evicted_time = 0; 
+    }
+
+    xSemaphoreGive(capture_read_lock); 
+
+    return item; 
+}
+
+/**
+ * @brief PRIVATE Take the next message from the highest priority channel that has one
+ * 
+ * @param channel set to the channel the message came from
+ * @param item_size 
+ * @return uint8_t* NULL if every channel is empty
+ */
+uint8_t* receive_next_message(comms_channel* channel, size_t* item_size) { 
+    for(size_t i = 0; i < COMMS_CHANNEL_COUNT; i++) { 
+        uint8_t* item = i == COMMS_CHANNEL_CAPTURE ? receive_capture_message(item_size) : 
+            (uint8_t*)xRingbufferReceive(channel_queues[i], item_size, 0); 
+
+        if(item != NULL) { 
+            *channel = (comms_channel)i; 
+            return item; 
+        }
+    }
+
+    return NULL; 
+}
+
+/**
+ * @brief Update method for the transmit task, blocks until a message is queued then 
+ * coalesces everything that arrives until either the flush size or the flush time is hit. 
+ * Channels are drained in priority order and control messages are flushed right away, so a 
+ * reply waits behind at most one chunk of capture data. 
+ * 
+ * If the flush time is shorter than a tick, only the messages already queued are coalesced. 
+ */
 void comms_update_tx() { 
-    for(size_t i = 0; i < message_queue.count; i++) {
-        assert(send_string("<") == 1);
-        send_formatted_data(message_queue.messages[i].data, message_queue.messages[i].data_length);
-        assert(send_string(">\n") == 2);
+    comms_channel channel; 
+    size_t item_size = 0; 
+
+    if(tx_task == NULL)
+        tx_task = xTaskGetCurrentTaskHandle(); 
+
+    uint8_t* item = receive_next_message(&channel, &item_size); 
+
+    if(item == NULL) { 
+        // Woken by the next queued message
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY); 
+        return; 
+    }
+
+    int64_t deadline = esp_timer_get_time() + tx_flush_us; 
+
+    while(item != NULL) { 
+        if(output_mode == OUTPUT_MODE_BINARY) { 
+            tx_chunk_append((const char*)item, item_size); 
+        } else { 
+            tx_chunk_append("<", 1); 
+            tx_chunk_append_hex(item, item_size); 
+            tx_chunk_append(">\n", 2); 
+        }
+
+        vRingbufferReturnItem(channel_queues[channel], item); 
+        count_queued(channel, item_size, false); 
+
+        if(channel == COMMS_CHANNEL_CONTROL || tx_chunk_len >= tx_flush_bytes)
+            break; 
+
+        item = receive_next_message(&channel, &item_size); 
+
+        if(item == NULL) { 
+            TickType_t wait = ticks_until(deadline); 
+
+            if(wait == 0)
+                break; 
 
-        free(message_queue.messages[i].data); //Free the shit
+            ulTaskNotifyTake(pdTRUE, wait); 
+            item = receive_next_message(&channel, &item_size); 
+        }
     }
 
-    //Clear the message queue 
-    message_queue.count = 0; 
+    tx_chunk_flush(); 
+}
+
+/**
+ * @brief Set the TX coalescing policy
+ * 
+ * @param flush_bytes flush once this many bytes are ready to be written
+ * @param flush_us flush once this many microseconds have passed since the first message
+ * @return esp_err_t ESP_ERR_INVALID_ARG if the flush size is zero or larger than the TX chunk
+ */
+esp_err_t comms_set_tx_coalescing(size_t flush_bytes, uint32_t flush_us) { 
+    if(flush_bytes == 0 || flush_bytes > COMMS_TX_CHUNK_SIZE)
+        return ESP_ERR_INVALID_ARG; 
+
+    tx_flush_bytes = flush_bytes; 
+    tx_flush_us = flush_us; 
+
+    return ESP_OK; 
+}
+
+/**
+ * @brief Set how messages are written to the host
+ * 
+ * @param mode 
+ * @return esp_err_t 
+ */
+esp_err_t comms_set_output_mode(comms_output_mode mode) { 
+    if(mode >= OUTPUT_MODE_COUNT)
+        return ESP_ERR_INVALID_ARG; 
+
+    output_mode = mode; 
+
+    return ESP_OK; 
+}
+
+/**
+ * @brief Get how messages are written to the host
+ * 
+ * @return comms_output_mode 
+ */
+comms_output_mode comms_get_output_mode() { 
+    return output_mode; 
+}
+
+/**
+ * @brief Check if a baud rate is in the range the UART supports
+ * 
+ * @param rate 
+ * @return true 
+ * @return false 
+ */
+bool comms_baud_rate_valid(uint32_t rate) { 
+    return rate >= COMMS_MIN_BAUD_RATE && rate <= COMMS_MAX_BAUD_RATE; 
+}
+
+/**
+ * @brief Set the UART baud rate, takes effect immediately if the UART is already running. The 
+ * rate is only kept once the UART accepts it, so a rejected rate can never be saved. 
+ * 
+ * @param rate 
+ * @return esp_err_t ESP_ERR_INVALID_ARG if the rate is out of range
+ */
+esp_err_t comms_set_baud_rate(uint32_t rate) { 
+    if(!comms_baud_rate_valid(rate))
+        return ESP_ERR_INVALID_ARG; 
+
+    if(!comms_initialized) { 
+        baud_rate = rate; 
+        return ESP_OK; 
+    }
+
+    // Let whatever is in flight go out at the old rate first
+    uart_wait_tx_done(UART_CHANNEL, 100 / portTICK_PERIOD_MS); 
+
+    esp_err_t err = uart_set_baudrate(UART_CHANNEL, rate); 
+
+    if(err == ESP_OK)
+        baud_rate = rate; 
+
+    return err; 
+}
+
+/**
+ * @brief Get the UART baud rate
+ * 
+ * @return uint32_t 
+ */
+uint32_t comms_get_baud_rate() { 
+    return baud_rate; 
 }
 
 /**
@@ -106,8 +451,6 @@ void comms_update_rx(comms_status_t *status, char *data) {
         while(update_progress_count != update_size) {             
             int update_byte_count = uart_read_bytes(UART_CHANNEL, update_buffer, RX_BUF_SIZE, 1000 / portTICK_PERIOD_MS); 
 
-            printf("Update count: %i\n", update_byte_count); 
-
             if(update_byte_count < 0) { 
                 ESP_LOGE("COMMS - UPDATE", "Invalid data recieved"); 
                 abort(); 
@@ -115,15 +458,18 @@ void comms_update_rx(comms_status_t *status, char *data) {
                 ESP_ERROR_CHECK(ota_do_update(update_buffer, update_byte_count)); 
                             
                 update_progress_count += update_byte_count;
-                printf("Progress: %i of %i\n", update_progress_count, update_size);
+
+                // Data: bytes written (4), update size (4)
+                uint32_t net_progress[2] = { htonl(update_progress_count), htonl(update_size) }; 
+                comms_send_control(CONTROL_UPDATE_PROGRESS, net_progress, sizeof(net_progress)); 
                 ESP_LOGD("COMMS - UPDATE", "Progress: %i of %i\n", update_progress_count, update_size);
             }
         } 
 
         status->update = false; 
+        // Restarts on success, the host sees CONTROL_READY once the new image is up
         ota_cleanup();
-        // send_data_with_length(update_data, update_size);
-        send_string("Update Complete. Restarting...");
+        comms_send_reply('u', ota_get_last_err()); 
 
         return;
     }
@@ -140,9 +486,158 @@ void comms_update_rx(comms_status_t *status, char *data) {
 
         if(strcmp(data, "m") == 0) {
             status->sniff = true; 
+            comms_send_reply('m', ESP_OK); 
         } 
         if(strcmp(data, "n") == 0) {
             status->sniff = false; 
+            comms_send_reply('n', ESP_OK); 
+        }
+
+        if(data[0] == 'c' && rx_bytes >= 1 + sizeof(uint32_t) * 2) { 
+            uint32_t flush_bytes; 
+            uint32_t flush_us; 
+
+            memcpy(&flush_bytes, data + 1, sizeof(uint32_t)); 
+            memcpy(&flush_us, data + 1 + sizeof(uint32_t), sizeof(uint32_t)); 
+
+            comms_send_reply('c', comms_set_tx_coalescing(ntohl(flush_bytes), ntohl(flush_us))); 
+        }
+
+        if(data[0] == 'p' && rx_bytes >= 2 + sizeof(uint32_t)) { 
+            uint32_t interval_ms; 
+
+            memcpy(&interval_ms, data + 2, sizeof(uint32_t)); 
+
+            comms_send_reply('p', backpressure_set_policy((backpressure_policy_t)data[1], ntohl(interval_ms))); 
+        }
+
+        if(data[0] == 'i' && rx_bytes >= 2) { 
+            isotp_set_enabled(data[1] != 0); 
+            comms_send_reply('i', ESP_OK); 
+        }
+
+        // Oversized lists are rejected before the length check, so the current list stays in place 
+        if(data[0] == 'l' && rx_bytes >= 2 && (uint8_t)data[1] > PID_POLL_MAX_ENTRIES) { 
+            comms_send_reply('l', ESP_ERR_INVALID_SIZE); 
+        } else if(data[0] == 'l' && rx_bytes >= 2 + (uint8_t)data[1] * PID_POLL_UPLOAD_ENTRY_LEN) { 
+            pid_poll_request_t requests[PID_POLL_MAX_ENTRIES]; 
+            size_t count = (uint8_t)data[1]; 
+
+            // Entry: service (1), pid (2), request id (4), response id (4), period ms (2)
+            for(size_t i = 0; i < count; i++) { 
+                const uint8_t* entry = (const uint8_t*)data + 2 + i * PID_POLL_UPLOAD_ENTRY_LEN; 
+                uint16_t pid, period_ms; 
+                uint32_t request_id, response_id; 
+
+                memcpy(&pid, entry + 1, sizeof(uint16_t)); 
+                memcpy(&request_id, entry + 3, sizeof(uint32_t)); 
+                memcpy(&response_id, entry + 7, sizeof(uint32_t)); 
+                memcpy(&period_ms, entry + 11, sizeof(uint16_t)); 
+
+                requests[i].service = entry[0]; 
+                requests[i].pid = ntohs(pid); 
+                requests[i].request_id = ntohl(request_id); 
+                requests[i].response_id = ntohl(response_id); 
+                requests[i].period_ms = ntohs(period_ms); 
+            }
+
+            esp_err_t err = pid_poll_set_list(requests, count); 
+
+            if(err == ESP_OK) { 
+                // Polling needs to transmit, listen only is restored once the list is cleared
+                twai_mode_t mode = count > 0 ? TWAI_MODE_NORMAL : default_g_config.mode; 
+
+                if(status->current_config.g_config.mode != mode) { 
+                    status->current_config.g_config.mode = mode; 
+                    status->reconfigure = true; 
+                }
+            }
+
+            comms_send_reply('l', err); 
+        }
+
+        if(data[0] == 'b' && rx_bytes >= 1 + sizeof(uint32_t)) { 
+            uint32_t bitrate; 
+
+            memcpy(&bitrate, data + 1, sizeof(uint32_t)); 
+            bitrate = ntohl(bitrate); 
+
+            esp_err_t err = can_bus_timing_for_bitrate(bitrate, &status->current_config.t_config); 
+
+            if(err == ESP_OK) { 
+                status->bitrate = bitrate; 
+                status->reconfigure = true; 
+            }
+
+            comms_send_reply('b', err); 
+        }
+
+        if(data[0] == 'f' && rx_bytes >= 2 + sizeof(uint32_t) * 2) { 
+            uint32_t acceptance_code, acceptance_mask; 
+
+            memcpy(&acceptance_code, data + 1, sizeof(uint32_t)); 
+            memcpy(&acceptance_mask, data + 1 + sizeof(uint32_t), sizeof(uint32_t)); 
+
+            status->current_config.f_config.acceptance_code = ntohl(acceptance_code); 
+            status->current_config.f_config.acceptance_mask = ntohl(acceptance_mask); 
+            status->current_config.f_config.single_filter = data[1 + sizeof(uint32_t) * 2] != 0; 
+            status->reconfigure = true; 
+            comms_send_reply('f', ESP_OK); 
+        }
+
+        if(data[0] == 'o' && rx_bytes >= 2) { 
+            comms_send_reply('o', comms_set_output_mode((comms_output_mode)data[1])); 
+        }
+
+        if(data[0] == 'r' && rx_bytes >= 1 + sizeof(uint32_t)) { 
+            uint32_t rate; 
+
+            memcpy(&rate, data + 1, sizeof(uint32_t)); 
+
+            comms_send_reply('r', comms_set_baud_rate(ntohl(rate))); 
+        }
+
+        if(data[0] == 'a' && rx_bytes >= 2) { 
+            status->auto_start = data[1] != 0; 
+            comms_send_reply('a', ESP_OK); 
+        }
+
+        if(strcmp(data, "w") == 0) { 
+            stored_config_t config; 
+
+            config_capture(status, &config); 
+
+            comms_send_reply('w', config_save(&config)); 
+        }
+
+        if(data[0] == 'x' && rx_bytes >= 1 + BENCHMARK_UPLOAD_LEN) { 
+            const uint8_t* upload = (const uint8_t*)data + 1; 
+            benchmark_profile_t profile; 
+            uint32_t bitrate, duration_ms; 
+            uint16_t load_percent, id_count, burst_len; 
+
+            // Upload: source (1), bitrate (4), load percent (2), min dlc (1), max dlc (1), 
+            // id count (2), burst length (2), duration ms (4)
+            memcpy(&bitrate, upload + 1, sizeof(uint32_t)); 
+            memcpy(&load_percent, upload + 5, sizeof(uint16_t)); 
+            memcpy(&id_count, upload + 9, sizeof(uint16_t)); 
+            memcpy(&burst_len, upload + 11, sizeof(uint16_t)); 
+            memcpy(&duration_ms, upload + 13, sizeof(uint32_t)); 
+
+            profile.source = (benchmark_source_t)upload[0]; 
+            profile.bitrate = ntohl(bitrate); 
+            profile.load_percent = ntohs(load_percent); 
+            profile.min_dlc = upload[7]; 
+            profile.max_dlc = upload[8]; 
+            profile.id_count = ntohs(id_count); 
+            profile.burst_len = ntohs(burst_len); 
+            profile.duration_ms = ntohl(duration_ms); 
+
+            comms_send_reply('x', benchmark_start(&profile, status)); 
+        }
+
+        if(strcmp(data, "s") == 0) { 
+            comms_send_reply('s', telemetry_send()); 
         }
 
         if(strcmp(data, "u") == 0) { 
@@ -157,7 +652,11 @@ void comms_update_rx(comms_status_t *status, char *data) {
 
             uart_flush(UART_CHANNEL); 
 
+#ifdef STATIC_MEMORY_PROFILE
+            update_buffer = update_buffer_storage; 
+#else
             update_buffer = (uint8_t*)malloc(sizeof(uint8_t) * RX_BUF_SIZE); 
+#endif
 
             if(update_buffer == NULL) { 
                 ESP_LOGE("COMMS - UPDATE", "Could not allocate memory for update buffer"); 
@@ -167,6 +666,7 @@ void comms_update_rx(comms_status_t *status, char *data) {
             ESP_ERROR_CHECK(ota_init());
 
             status->update = true; 
+            comms_send_reply('u', ESP_OK); 
         }
        
     }
@@ -177,64 +677,374 @@ void comms_update_rx(comms_status_t *status, char *data) {
  * @brief Create a message
  * 
  * @param src 
+ * @param channel 
  * @param data 
  * @param len 
  * @return comms_message_t 
  */
-esp_err_t create_message(comms_message_t* src, void* data, uint32_t len) { 
-    // Calculate the CRC16 and convert it to network byte order
-    size_t crc_arr_len = sizeof(uint16_t);
-    uint8_t crc_arr[crc_arr_len]; 
-    uint16_t crc16 = htons(calculate_crc16(data, len));
-    memcpy(crc_arr, &crc16, crc_arr_len); 
+esp_err_t create_message(comms_message_t* src, comms_channel channel, void* data, uint32_t len) { 
+    return create_record_message(src, channel, NULL, 0, data, len); 
+}
 
-    // Create a temporary data length variable
-    size_t data_len = len; 
+/**
+ * @brief Append a uint32_t in network byte order, for building record data 
+ * 
+ * @param dst 
+ * @param value 
+ * @return size_t bytes written
+ */
+size_t comms_put_u32(uint8_t* dst, uint32_t value) { 
+    uint32_t net_value = htonl(value); 
+    memcpy(dst, &net_value, sizeof(uint32_t)); 
+    return sizeof(uint32_t); 
+}
+
+/**
+ * @brief Append a uint16_t in network byte order, for building record data 
+ * 
+ * @param dst 
+ * @param value 
+ * @return size_t bytes written
+ */
+size_t comms_put_u16(uint8_t* dst, uint16_t value) { 
+    uint16_t net_value = htons(value); 
+    memcpy(dst, &net_value, sizeof(uint16_t)); 
+    return sizeof(uint16_t); 
+}
 
-    // Convert the length to network byte order and set it to the length array
-    size_t message_len_arr_len = sizeof(uint32_t); 
-    uint8_t message_len_arr[message_len_arr_len]; 
+/**
+ * @brief PRIVATE Fill in the framing around a payload that is already in place: channel (1), 
+ * length (4), payload, crc16 (2). The crc16 covers the channel and payload. 
+ * 
+ * @param dst payload starts at dst + COMMS_FRAME_HEADER_LEN
+ * @param channel 
+ * @param len payload length
+ * @return size_t framed length
+ */
+HOT_PATH_ATTR size_t seal_frame(uint8_t* dst, comms_channel channel, uint32_t len) { 
     uint32_t net_len = htonl(len); 
-    memcpy(message_len_arr, &net_len, message_len_arr_len);
+    uint8_t* payload = dst + COMMS_FRAME_HEADER_LEN; 
+
+    dst[0] = (uint8_t)channel; 
+    memcpy(dst + 1, &net_len, sizeof(uint32_t)); 
 
+    // Calculate the CRC16 and convert it to network byte order
+    uint16_t crc16 = crc16_update(0xffff, dst, 1); 
+    crc16 = htons(crc16_update(crc16, payload, len) ^ 0xffff); 
+    memcpy(payload + len, &crc16, sizeof(uint16_t)); 
+
+    return COMMS_FRAME_OVERHEAD + len; 
+}
+
+/**
+ * @brief PRIVATE Frame a header and data into dst
+ * 
+ * @param dst must fit header_len + data_len + COMMS_FRAME_OVERHEAD bytes
+ * @param channel 
+ * @param header 
+ * @param header_len 
+ * @param data 
+ * @param data_len 
+ * @return size_t framed length
+ */
+HOT_PATH_ATTR size_t frame_message(uint8_t* dst, comms_channel channel, const void* header, uint32_t header_len, const void* data, uint32_t data_len) { 
+    if(header_len > 0)
+        memcpy(dst + COMMS_FRAME_HEADER_LEN, header, header_len); 
+    if(data_len > 0)
+        memcpy(dst + COMMS_FRAME_HEADER_LEN + header_len, data, data_len); 
+
+    return seal_frame(dst, channel, header_len + data_len); 
+}
+
+/**
+ * @brief Create a message from a record header and record data, the two are framed as one
+ * message body without copying them together first
+ * 
+ * @param src 
+ * @param channel 
+ * @param header 
+ * @param header_len 
+ * @param data 
+ * @param data_len 
+ * @return esp_err_t 
+ */
+HOT_PATH_ATTR esp_err_t create_record_message(comms_message_t* src, comms_channel channel, void* header, uint32_t header_len, void* data, uint32_t data_len) { 
     // Allocate the memory in the message struct to send 
-    size_t message_data_len = message_len_arr_len + data_len + crc_arr_len;
-    // free(src->data); // Bug ??? 
-    // printf("Message Data Len: %dbytes Heap Free: %ldbytes\n", message_data_len, xPortGetFreeHeapSize()); 
+    size_t message_data_len = COMMS_FRAME_OVERHEAD + header_len + data_len; 
+
+#ifdef STATIC_MEMORY_PROFILE
+    if(message_data_len > COMMS_MESSAGE_MAX_LEN)
+        return ESP_ERR_INVALID_SIZE; 
 
+    src->data = message_scratch; 
+#else
     if(xPortGetFreeHeapSize() < message_data_len) 
         return ESP_ERR_NO_MEM;
  
     src->data = (uint8_t*)malloc(sizeof(uint8_t) * message_data_len); 
-    memset(src->data, 0, message_data_len);
 
-    // Copy the length to the beggining on the data array
-    memcpy(src->data, message_len_arr, message_len_arr_len); 
-    // Copy the CAN data to the message data after the length
-    memcpy(src->data + message_len_arr_len, data, data_len); 
-    // Copy the crc16 data at the end of the message data
-    memcpy(src->data + message_len_arr_len + data_len, crc_arr, crc_arr_len); 
+    if(src->data == NULL)
+        return ESP_ERR_NO_MEM; 
+#endif
 
-    // Set the total length of the message data (message length + data length array length)
-    src->data_length = message_data_len;
+    src->data_length = frame_message(src->data, channel, header, header_len, data, data_len); 
 
     return ESP_OK; 
 }
 
 /**
- * @brief Add a message to the message queue
+ * @brief PRIVATE Account for a message entering or leaving a channel queue. A no-split item 
+ * takes its length rounded up to 32 bits plus the item header. 
+ * 
+ * @param channel 
+ * @param item_size message length
+ * @param added true when queued, false when received or evicted
+ */
+HOT_PATH_ATTR static void count_queued(comms_channel channel, size_t item_size, bool added) { 
+    size_t footprint = ((item_size + 3) & ~(size_t)3) + COMMS_RINGBUF_ITEM_HEADER; 
+
+    portENTER_CRITICAL(&queued_lock); 
+    if(added)
+        queued_bytes[channel] += footprint; 
+    else
+        queued_bytes[channel] -= footprint < queued_bytes[channel] ? footprint : queued_bytes[channel]; 
+    portEXIT_CRITICAL(&queued_lock); 
+}
+
+/**
+ * @brief PRIVATE Queue a framed message on its channel and wake the transmit task
+ * 
+ * @param data framed message, the first byte is the channel
+ * @param len 
+ * @return true 
+ * @return false the channel queue is full or not created yet
+ */
+HOT_PATH_ATTR bool queue_message(const uint8_t* data, size_t len) { 
+    RingbufHandle_t queue = channel_queues[data[0]]; 
+
+    if(queue == NULL || xRingbufferSend(queue, data, len, 0) != pdTRUE)
+        return false; 
+
+    count_queued((comms_channel)data[0], len, true); 
+
+    if(tx_task != NULL)
+        xTaskNotifyGive(tx_task); 
+
+    return true; 
+}
+
+/**
+ * @brief Add a message to its channel queue, the message data is copied into the queue and freed
  * 
  * @param message message data
+ * @return true 
+ * @return false the channel queue was full and the message was dropped
  */
-void add_message(comms_message_t* message) {
-    if(message_queue.count > MESSAGE_QUEUE_LEN) {
-        ESP_LOGE("COMMS", "MESSAGE QUEUE OVERRUN"); 
-        return; 
+HOT_PATH_ATTR bool add_message(comms_message_t* message) {
+    assert(message != NULL); 
+
+    bool queued = queue_message(message->data, message->data_length); 
+
+    // Capture drops are reported in the stream by the backpressure module, logging them here 
+    // would only add to the overrun
+    if(!queued && message->data[0] == COMMS_CHANNEL_CAPTURE) { 
+        queue_drop_count++; 
+        backpressure_count_drops(1); 
     }
 
-    assert(message != NULL); 
+#ifndef STATIC_MEMORY_PROFILE
+    free(message->data); 
+#endif
+    message->data = NULL; 
+
+    return queued; 
+}
+
+/**
+ * @brief Send a message on the control channel, safe to call from any task
+ * 
+ * Data: kind (1), data
+ * 
+ * @param kind 
+ * @param data 
+ * @param data_len at most COMMS_CONTROL_MAX_DATA bytes
+ * @return esp_err_t ESP_ERR_NO_MEM if the control queue is full
+ */
+esp_err_t comms_send_control(comms_control_kind kind, const void* data, size_t data_len) { 
+    uint8_t message[COMMS_FRAME_OVERHEAD + 1 + COMMS_CONTROL_MAX_DATA]; 
+    uint8_t kind_byte = (uint8_t)kind; 
+
+    if(data_len > COMMS_CONTROL_MAX_DATA)
+        return ESP_ERR_INVALID_SIZE; 
 
-    message_queue.messages[message_queue.count++] = *message; 
+    size_t len = frame_message(message, COMMS_CHANNEL_CONTROL, &kind_byte, 1, data, data_len); 
+
+    return queue_message(message, len) ? ESP_OK : ESP_ERR_NO_MEM; 
+}
+
+/**
+ * @brief Reply to a host command on the control channel
+ * 
+ * @param command command character
+ * @param result 
+ * @return esp_err_t 
+ */
+esp_err_t comms_send_reply(char command, esp_err_t result) { 
+    uint8_t data[1 + sizeof(uint32_t)]; 
+    uint32_t net_result = htonl((uint32_t)result); 
+
+    data[0] = (uint8_t)command; 
+    memcpy(data + 1, &net_result, sizeof(uint32_t)); 
+
+    return comms_send_control(CONTROL_REPLY, data, sizeof(data)); 
+}
+
+/**
+ * @brief PRIVATE Take log channel budget for a message
+ * 
+ * @param len framed message length
+ * @param dropped set to the lines dropped since the last admitted one, when admitted
+ * @return true 
+ * @return false over the rate cap, the line is counted as dropped
+ */
+static bool log_admit(size_t len, uint32_t* dropped) { 
+    int64_t now = esp_timer_get_time(); 
+    bool admit; 
+
+    portENTER_CRITICAL(&log_lock); 
+
+    // Only whole bytes are refilled, the remainder keeps accruing from the old refill time
+    int64_t refill = (now - log_refill_time) * COMMS_LOG_RATE_BYTES / 1000000; 
+
+    if(refill > 0) { 
+        log_tokens = log_tokens + refill > COMMS_LOG_BURST_BYTES ? COMMS_LOG_BURST_BYTES : log_tokens + refill; 
+        log_refill_time = now; 
+    }
+
+    admit = log_tokens >= (int32_t)len; 
+
+    if(admit) { 
+        log_tokens -= len; 
+        *dropped = log_drop_count; 
+        log_drop_count = 0; 
+    } else { 
+        log_drop_count++; 
+    }
+
+    portEXIT_CRITICAL(&log_lock); 
+
+    return admit; 
+}
+
+/**
+ * @brief PRIVATE esp_log output hook, every line becomes one log channel message. Trailing 
+ * newlines are stripped, the framing already delimits lines. 
+ * 
+ * Data: lines dropped before this one (4), text
+ * 
+ * @param format 
+ * @param args 
+ * @return int 
+ */
+static int log_vprintf(const char* format, va_list args) { 
+    uint8_t message[COMMS_FRAME_OVERHEAD + sizeof(uint32_t) + COMMS_LOG_LINE_LEN]; 
+    uint8_t* payload = message + COMMS_FRAME_HEADER_LEN; 
+    char* text = (char*)payload + sizeof(uint32_t); 
+    uint32_t dropped; 
+
+    int len = vsnprintf(text, COMMS_LOG_LINE_LEN, format, args); 
+
+    if(len <= 0)
+        return len; 
+
+    size_t text_len = len < COMMS_LOG_LINE_LEN ? len : COMMS_LOG_LINE_LEN - 1; 
+
+    while(text_len > 0 && (text[text_len - 1] == '\n' || text[text_len - 1] == '\r'))
+        text_len--; 
+
+    if(text_len == 0 || !log_admit(COMMS_FRAME_OVERHEAD + sizeof(uint32_t) + text_len, &dropped))
+        return len; 
+
+    // The text is already in place, frame it without copying
+    uint32_t net_dropped = htonl(dropped); 
+    memcpy(payload, &net_dropped, sizeof(uint32_t)); 
+
+    size_t message_len = seal_frame(message, COMMS_CHANNEL_LOG, sizeof(uint32_t) + text_len); 
+
+    if(!queue_message(message, message_len)) { 
+        portENTER_CRITICAL(&log_lock); 
+        log_drop_count++; 
+        portEXIT_CRITICAL(&log_lock); 
+    }
+
+    return len; 
+}
+
+/**
+ * @brief Get how full the message queue is
+ * 
+ * @return uint8_t fill level in percent
+ */
+HOT_PATH_ATTR uint8_t comms_queue_fill() { 
+    size_t used = queued_bytes[COMMS_CHANNEL_CAPTURE]; 
+
+    if(used >= MESSAGE_QUEUE_SIZE)
+        return 100; 
+
+    return (uint8_t)((used * 100) / MESSAGE_QUEUE_SIZE); 
+}
+
+/**
+ * @brief Get the number of messages dropped because the queue was full, only messages queued
+ * under the record lock are counted
+ * 
+ * @return uint32_t 
+ */
+uint32_t comms_get_queue_drop_count() { 
+    return queue_drop_count; 
+}
+
+/**
+ * @brief Get the number of bytes written to the UART since boot
+ * 
+ * @return uint32_t 
+ */
+uint32_t comms_get_tx_byte_count() { 
+    return tx_byte_count; 
+}
+
+/**
+ * @brief Evict the oldest queued messages until a message of the given size fits. 
+ * At most BACKPRESSURE_MAX_EVICT messages are evicted per call, their time deltas are added to 
+ * the next capture record sent. 
+ * 
+ * @param len size of the message that needs to fit
+ * @return size_t number of messages evicted
+ */
+HOT_PATH_ATTR size_t comms_drop_oldest(size_t len) { 
+    size_t evicted = 0; 
+
+    xSemaphoreTake(capture_read_lock, portMAX_DELAY); 
+
+    while(evicted < BACKPRESSURE_MAX_EVICT && xRingbufferGetCurFreeSize(message_queue) < len) { 
+        size_t item_size; 
+        uint8_t* item = (uint8_t*)xRingbufferReceive(message_queue, &item_size, 0); 
+
+        if(item == NULL)
+            break; 
+
+        // Carried over to the next record sent so the host clock keeps this record's delta
+        if(item_size >= COMMS_FRAME_OVERHEAD + sizeof(uint32_t))
+            evicted_time += record_time(item); 
+
+        vRingbufferReturnItem(message_queue, item); 
+        count_queued(COMMS_CHANNEL_CAPTURE, item_size, false); 
+        evicted++; 
+    }
+
+    xSemaphoreGive(capture_read_lock); 
+
+    return evicted; 
 }
 
 /**
@@ -261,19 +1071,21 @@ int send_string(char* data) {
  * @param int
  */
 int send_formatted_data(uint8_t* data, size_t len) { 
-    //Reformat the data to ASCII
-    char output_data[len * 4]; //Len * 4 because each aditional char is a 4 byte string
-    memset(output_data, 0, len * 4); 
+    //Reformat the data to ASCII a piece at a time so large messages don't blow the stack
+    char output_data[64]; 
 
     int bytes_written = 0; 
 
-    for(size_t i = 0; i < len; i++) { 
-        char tmp_output[4];
-        sprintf(tmp_output, "%02X", data[i]); 
-        strcat(output_data, tmp_output); 
-    }
+    for(size_t i = 0; i < len; i += sizeof(output_data) / 2) { 
+        size_t piece_len = len - i < sizeof(output_data) / 2 ? len - i : sizeof(output_data) / 2; 
+
+        for(size_t j = 0; j < piece_len; j++) { 
+            output_data[j * 2] = hex_digits[data[i + j] >> 4]; 
+            output_data[j * 2 + 1] = hex_digits[data[i + j] & 0x0F]; 
+        }
 
-    bytes_written = send_string(output_data); 
+        bytes_written += send_data_with_length((uint8_t*)output_data, piece_len * 2); 
+    }
 
 #ifdef COMMS_DEBUG
     printf("\n\nDEBUG: Len: %d Bytes Written: %d\n\n", len, bytes_written);
@@ -304,7 +1116,12 @@ int send_data_with_length(uint8_t* data, size_t len) {
     printf("\n");
 #endif
 
-    return uart_write_bytes(UART_CHANNEL, data, len); 
+    int bytes_written = uart_write_bytes(UART_CHANNEL, data, len); 
+
+    if(bytes_written > 0)
+        tx_byte_count += bytes_written; 
+
+    return bytes_written; 
 }
 
 /**
@@ -350,13 +1167,15 @@ uint16_t crc_table[256] = {
     0xFBCF, 0xEA46, 0xD8DD, 0xC954, 0xBDEB, 0xAC62, 0x9EF9, 0x8F70
 };
 
-uint16_t calculate_crc16(uint8_t* data, size_t len){ 
-    uint16_t ret = 0xffff; 
-
-    for(int i = 0; i < len; i++) { 
-        int lui = (ret ^ *(data + i)) & 0xff; 
-        ret = (ret >> 8) ^ crc_table[lui]; 
+HOT_PATH_ATTR uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t len) { 
+    for(size_t i = 0; i < len; i++) { 
+        int lui = (crc ^ *(data + i)) & 0xff; 
+        crc = (crc >> 8) ^ crc_table[lui]; 
     }
 
-    return ret ^ 0xffff; 
+    return crc; 
+}
+
+uint16_t calculate_crc16(uint8_t* data, size_t len){ 
+    return crc16_update(0xffff, data, len) ^ 0xffff; 
 }
\ No newline at end of file
@@ -6,9 +6,38 @@
 #include "defines.h"
 #include "can_bus.h"
 
+typedef enum comms_output_mode { 
+    OUTPUT_MODE_HEX = 0,    // <HEX>\n per message
+    OUTPUT_MODE_BINARY = 1, // Raw length prefixed, crc16 terminated messages, half the bandwidth
+    OUTPUT_MODE_COUNT
+} comms_output_mode; 
+
+// Every message on the UART is framed as channel (1), length (4), payload, crc16 (2). The 
+// transmit task drains the channels in priority order, control first and capture last. 
+typedef enum comms_channel { 
+    COMMS_CHANNEL_CONTROL = 0,      // Command replies, boot and update status
+    COMMS_CHANNEL_TELEMETRY = 1,    // Telemetry and benchmark records
+    COMMS_CHANNEL_LOG = 2,          // esp_log output, rate capped by COMMS_LOG_RATE_BYTES
+    COMMS_CHANNEL_CAPTURE = 3,      // Frames and everything timed against them
+    COMMS_CHANNEL_COUNT
+} comms_channel; 
+
+#define COMMS_FRAME_HEADER_LEN 5 // Channel (1) + length (4)
+#define COMMS_FRAME_OVERHEAD (COMMS_FRAME_HEADER_LEN + 2) // Header + crc16
+#define COMMS_CONTROL_MAX_DATA 8
+
+typedef enum comms_control_kind { 
+    CONTROL_READY = 0,              // Tasks are running: running an OTA image (1)
+    CONTROL_REPLY = 1,              // Command result: command (1), esp_err_t (4)
+    CONTROL_UPDATE_PROGRESS = 2     // Bytes written (4), update size (4)
+} comms_control_kind; 
+
 typedef struct comms_status_t { 
     bool sniff; 
     bool update; 
+    bool reconfigure; // Restart the CAN driver to apply current_config
+    bool auto_start; // Start sniffing at boot, persisted with the 'w' command
+    uint32_t bitrate; 
     can_config_t current_config; 
 } comms_status_t; 
 
@@ -18,11 +47,27 @@ typedef struct comms_message_t {
 } comms_message_t; 
 
 void comms_update_tx(); 
+esp_err_t comms_set_tx_coalescing(size_t flush_bytes, uint32_t flush_us); 
+esp_err_t comms_set_output_mode(comms_output_mode mode); 
+comms_output_mode comms_get_output_mode(); 
+bool comms_baud_rate_valid(uint32_t rate); 
+esp_err_t comms_set_baud_rate(uint32_t baud_rate); 
+uint32_t comms_get_baud_rate(); 
 void comms_update_rx(comms_status_t* status, char *data); 
 
-void add_message(comms_message_t* message); 
+esp_err_t comms_send_control(comms_control_kind kind, const void* data, size_t data_len); 
+esp_err_t comms_send_reply(char command, esp_err_t result); 
+
+bool add_message(comms_message_t* message); 
+uint8_t comms_queue_fill(); 
+uint32_t comms_get_queue_drop_count(); 
+uint32_t comms_get_tx_byte_count(); 
+size_t comms_drop_oldest(size_t len); 
 
-esp_err_t create_message(comms_message_t *src, void *data, uint32_t len); 
+esp_err_t create_message(comms_message_t *src, comms_channel channel, void *data, uint32_t len); 
+esp_err_t create_record_message(comms_message_t *src, comms_channel channel, void *header, uint32_t header_len, void *data, uint32_t data_len); 
+size_t comms_put_u32(uint8_t* dst, uint32_t value); 
+size_t comms_put_u16(uint8_t* dst, uint16_t value); 
 esp_err_t comms_init(); 
 
 void clear_screen(); 
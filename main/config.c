@@ -0,0 +1,112 @@
+#include "config.h"
+#include "can_bus.h"
+#include <string.h>
+#include <nvs.h>
+#include <esp_log.h>
+
+/**
+ * @brief Load the stored configuration from NVS
+ * 
+ * @param config 
+ * @return esp_err_t ESP_ERR_NVS_NOT_FOUND if nothing is stored, ESP_ERR_INVALID_VERSION if the 
+ * stored blob is from an incompatible firmware
+ */
+esp_err_t config_load(stored_config_t* config) { 
+    nvs_handle_t handle; 
+    size_t size = sizeof(stored_config_t); 
+    esp_err_t err; 
+
+    err = nvs_open(STORED_CONFIG_NAMESPACE, NVS_READONLY, &handle); 
+    if(err != ESP_OK)
+        return err; 
+
+    err = nvs_get_blob(handle, STORED_CONFIG_KEY, config, &size); 
+    nvs_close(handle); 
+
+    if(err != ESP_OK)
+        return err; 
+
+    if(size != sizeof(stored_config_t) || config->version != STORED_CONFIG_VERSION || config->size != sizeof(stored_config_t))
+        return ESP_ERR_INVALID_VERSION; 
+
+    return ESP_OK; 
+}
+
+/**
+ * @brief Write the configuration to NVS
+ * 
+ * @param config 
+ * @return esp_err_t 
+ */
+esp_err_t config_save(const stored_config_t* config) { 
+    nvs_handle_t handle; 
+    esp_err_t err; 
+
+    err = nvs_open(STORED_CONFIG_NAMESPACE, NVS_READWRITE, &handle); 
+    if(err != ESP_OK)
+        return err; 
+
+    err = nvs_set_blob(handle, STORED_CONFIG_KEY, config, sizeof(stored_config_t)); 
+
+    if(err == ESP_OK)
+        err = nvs_commit(handle); 
+
+    nvs_close(handle); 
+
+    return err; 
+}
+
+/**
+ * @brief Build a stored configuration from the running configuration
+ * 
+ * @param status 
+ * @param config 
+ */
+void config_capture(const comms_status_t* status, stored_config_t* config) { 
+    memset(config, 0, sizeof(stored_config_t)); 
+
+    config->version = STORED_CONFIG_VERSION; 
+    config->size = sizeof(stored_config_t); 
+    config->bitrate = status->bitrate; 
+    config->acceptance_code = status->current_config.f_config.acceptance_code; 
+    config->acceptance_mask = status->current_config.f_config.acceptance_mask; 
+    config->single_filter = status->current_config.f_config.single_filter; 
+    config->output_mode = (uint8_t)comms_get_output_mode(); 
+    config->auto_start = status->auto_start; 
+    config->baud_rate = comms_get_baud_rate(); 
+}
+
+/**
+ * @brief Apply a stored configuration, called before the tasks start so an auto start 
+ * configuration goes straight into capture. Every field is checked before any is applied, so 
+ * an invalid configuration leaves the defaults untouched. 
+ * 
+ * @param config 
+ * @param status 
+ * @return esp_err_t 
+ */
+esp_err_t config_apply(const stored_config_t* config, comms_status_t* status) { 
+    twai_timing_config_t t_config; 
+    esp_err_t err; 
+
+    err = can_bus_timing_for_bitrate(config->bitrate, &t_config); 
+    if(err != ESP_OK)
+        return err; 
+
+    if(config->output_mode >= OUTPUT_MODE_COUNT || !comms_baud_rate_valid(config->baud_rate))
+        return ESP_ERR_INVALID_ARG; 
+
+    // Comms isn't up yet, neither of these can fail once validated
+    comms_set_output_mode((comms_output_mode)config->output_mode); 
+    comms_set_baud_rate(config->baud_rate); 
+
+    status->current_config.t_config = t_config; 
+    status->bitrate = config->bitrate; 
+    status->current_config.f_config.acceptance_code = config->acceptance_code; 
+    status->current_config.f_config.acceptance_mask = config->acceptance_mask; 
+    status->current_config.f_config.single_filter = config->single_filter; 
+    status->auto_start = config->auto_start; 
+    status->sniff = config->auto_start; 
+
+    return ESP_OK; 
+}
@@ -0,0 +1,34 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "defines.h"
+#include "comms.h"
+
+#include <stdint.h>
+#include <esp_err.h>
+
+#define STORED_CONFIG_NAMESPACE "canshark"
+#define STORED_CONFIG_KEY "config"
+#define STORED_CONFIG_VERSION 1
+
+// Persisted as a blob, only ever append fields and bump STORED_CONFIG_VERSION
+typedef struct stored_config_t { 
+    uint16_t version; 
+    uint16_t size; 
+    uint32_t bitrate; 
+    uint32_t acceptance_code; 
+    uint32_t acceptance_mask; 
+    uint8_t single_filter; 
+    uint8_t output_mode; 
+    uint8_t auto_start; 
+    uint8_t reserved; 
+    uint32_t baud_rate; 
+} stored_config_t; 
+
+esp_err_t config_load(stored_config_t* config); 
+esp_err_t config_save(const stored_config_t* config); 
+
+void config_capture(const comms_status_t* status, stored_config_t* config); 
+esp_err_t config_apply(const stored_config_t* config, comms_status_t* status); 
+
+#endif
@@ -1,15 +1,109 @@
 #include <esp_system.h>
+#include <esp_attr.h>
 #define CAN_BUS_TX_GPIO_NUM  GPIO_NUM_22
 #define CAN_BUS_RX_GPIO_NUM  GPIO_NUM_21
 #define UART_TXD_PIN GPIO_NUM_1
 #define UART_RXD_PIN GPIO_NUM_3
 #define UART_CHANNEL UART_NUM_0
+#define COMMS_DEFAULT_BAUD_RATE 115200
+#define COMMS_MIN_BAUD_RATE 9600
+#define COMMS_MAX_BAUD_RATE 5000000 // UART0 tops out at 5 Mbaud
 
 #define RX_BUF_SIZE 512
 #define TX_BUF_SIZE 128 //TODO(Demi): Calculate the maximum message size to be sent to the host pc
 #define MESSAGE_QUEUE_LEN 2048
+#define MESSAGE_QUEUE_ITEM_SIZE 36 // 25 byte CAN message padded to 28 + 8 byte ring buffer item header
+#define MESSAGE_QUEUE_SIZE (MESSAGE_QUEUE_LEN * MESSAGE_QUEUE_ITEM_SIZE)
+#define COMMS_RINGBUF_ITEM_HEADER 8 // Length and flags words ahead of every no-split ring buffer item
+
+// The capture channel uses the message queue above, the other UART channels get their own 
+// smaller queues
+#define COMMS_CONTROL_QUEUE_SIZE 1024
+#define COMMS_TELEMETRY_QUEUE_SIZE 2048
+#define COMMS_LOG_QUEUE_SIZE 4096
+
+// Log channel, lines are truncated to COMMS_LOG_LINE_LEN and capped at COMMS_LOG_RATE_BYTES per
+// second with bursts up to COMMS_LOG_BURST_BYTES, anything over is dropped and counted
+#define COMMS_LOG_LINE_LEN 128
+#define COMMS_LOG_RATE_BYTES 1024
+#define COMMS_LOG_BURST_BYTES 2048
+
+// TX coalescing, the transmit task flushes to the UART once COMMS_TX_FLUSH_BYTES have been
+// formatted or COMMS_TX_FLUSH_US have passed since the first queued message, whichever comes first
+#define COMMS_TX_CHUNK_SIZE 1024
+#define COMMS_TX_FLUSH_BYTES 256
+#define COMMS_TX_FLUSH_US 500
 
 #define CAN_TICKS_TO_WAIT 100
+#define CAN_BUS_EVENT_INTERVAL_MS 10 // Minimum time between non state change BUS_EVENT records
+
+// Backpressure, the overload policy engages when the message queue fill percentage reaches
+// the high water mark and releases once it drains below the low water mark
+#define BACKPRESSURE_HIGH_WATER 75
+#define BACKPRESSURE_LOW_WATER 25
+#define BACKPRESSURE_DEFAULT_INTERVAL_MS 100
+#define BACKPRESSURE_ID_TABLE_LEN 256
+#define BACKPRESSURE_MAX_EVICT 8
+
+// ISO-TP reassembly, sessions are tracked per sender ID and reassembled into pooled buffers
+#define ISOTP_MAX_SESSIONS 8
+#define ISOTP_POOL_BUFFERS 4
+#define ISOTP_MAX_PDU_LEN 4095
+#define ISOTP_TIMEOUT_MS 1000 // N_Cr, consecutive frame timeout
+
+// PID polling, at most one request is in flight per response ID, requests to different ECUs
+// are pipelined
+#define PID_POLL_MAX_ENTRIES 32
+#define PID_POLL_MAX_RESPONSE_LEN 64
+#define PID_POLL_TIMEOUT_MS 50 // P2 client
+#define PID_POLL_PENDING_TIMEOUT_MS 5000 // P2* client, after a response pending NRC
+#define PID_POLL_PADDING 0xAA
+
+// Benchmark, runs start BENCHMARK_SETTLE_MS after the request so the driver restart for self 
+// test mode lands outside the measurement window
+#define BENCHMARK_SETTLE_MS 100
+#define BENCHMARK_BASE_ID 0x100
+#define BENCHMARK_YIELD_MS 1000 // Inject runs let the idle task have a tick at least this often
+
+// Task stack sizes in bytes, check the telemetry stack high water marks before shrinking these
+#define CAN_BUS_TASK_STACK_SIZE (1024*3)
+#define COMMS_TX_TASK_STACK_SIZE (2048*2)
+#define COMMS_RX_TASK_STACK_SIZE (2048*2)
+
+#define COMMS_MESSAGE_MAX_LEN (ISOTP_MAX_PDU_LEN + 64) // Largest framed message (channel + length + record + crc16)
+
+/**
+ * Memory budget, everything below is allocated once at boot
+ * 
+ *  Message queue       MESSAGE_QUEUE_SIZE          72 KiB
+ *  Channel queues      COMMS_*_QUEUE_SIZE          7 KiB
+ *  Backpressure IDs    BACKPRESSURE_ID_TABLE_LEN   ~10 KiB
+ *  ISO-TP buffers      ISOTP_POOL_BUFFERS          16 KiB
+ *  Message scratch     COMMS_MESSAGE_MAX_LEN       4 KiB (STATIC_MEMORY_PROFILE only)
+ *  Task stacks         CAN + TX + RX               11 KiB
+ *  TX chunk            COMMS_TX_CHUNK_SIZE         1 KiB
+ *  RX / OTA buffers    RX_BUF_SIZE * 2             1 KiB
+ *  UART driver         RX_BUF_SIZE * 2             1 KiB (driver owned, always heap)
+ *  TWAI driver         rx/tx_queue_len             <1 KiB (driver owned, always heap)
+ * 
+ * With STATIC_MEMORY_PROFILE defined the tasks, message queue, locks and buffers are placed in 
+ * .bss instead of the heap, and messages are built in a static scratch buffer instead of being
+ * malloc'd per frame, so a build that links will not run out of memory at runtime. 
+ * 
+ * With IRAM_HOT_PATH defined the per-frame receive path is placed in IRAM, down through the 
+ * record encoding and queue helpers, so our own code never stalls on a flash cache miss. Report, 
+ * summary and error senders stay in flash as they only run now and then, and so do the TWAI 
+ * driver calls. Enable CONFIG_TWAI_ISR_IN_IRAM as well to keep the TWAI ISR running during 
+ * flash writes (OTA, NVS). 
+ */
+// #define STATIC_MEMORY_PROFILE
+// #define IRAM_HOT_PATH
+
+#ifdef IRAM_HOT_PATH
+#define HOT_PATH_ATTR IRAM_ATTR
+#else
+#define HOT_PATH_ATTR
+#endif
 
 // #define CAN_DEBUG
 // #define COMMS_DEBUG
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include "isotp.h"
+#include "can_bus.h"
+#include <string.h>
+#include <lwip/sockets.h>
+
+// PDU record data: partner ID with the extended flag in the top bit (4), start time (4), end time (4), payload
+#define ISOTP_PDU_HEADER_LEN (sizeof(uint32_t) * 3)
+
+#define ISOTP_PCI_SINGLE 0x0
+#define ISOTP_PCI_FIRST 0x1
+#define ISOTP_PCI_CONSECUTIVE 0x2
+#define ISOTP_PCI_FLOW_CONTROL 0x3
+
+#define ISOTP_FC_OVERFLOW 0x2
+
+typedef struct isotp_buffer_t {
+    bool used;
+    uint8_t data[ISOTP_PDU_HEADER_LEN + ISOTP_MAX_PDU_LEN];
+} isotp_buffer_t;
+
+typedef struct isotp_session_t {
+    bool used;
+    uint32_t key;               // Sender CAN ID with the extended flag in the top bit
+    uint32_t partner_id;        // Key of the other end of the ID pair, 0 for functional IDs
+    isotp_buffer_t* buffer;
+    uint16_t length;            // Length announced by the first frame
+    uint16_t received;
+    uint8_t next_sequence;
+    int64_t start_time;
+    int64_t last_time;
+} isotp_session_t;
+
+/// Private variables
+// Requested by the host command task, applied by the CAN task in isotp_update
+static volatile bool requested_enabled = false;
+static bool enabled = false;
+
+static isotp_session_t sessions[ISOTP_MAX_SESSIONS];
+static isotp_buffer_t pool[ISOTP_POOL_BUFFERS];
+
+/// Private function pre declarations
+static void send_error(uint32_t key, isotp_error_t error, uint16_t length, uint16_t received);
+static void send_pdu(isotp_session_t* session, uint8_t* payload, uint16_t length, int64_t end_time);
+static void close_session(isotp_session_t* session);
+
+/**
+ * @brief Enable or disable ISO-TP reassembly, it is applied by the CAN task on its next update
+ *
+ * @param enable
+ */
+void isotp_set_enabled(bool enable) {
+    requested_enabled = enable;
+}
+
+/**
+ * @brief Check if ISO-TP reassembly is enabled
+ *
+ * @return true
+ * @return false
+ */
+bool isotp_is_enabled() {
+    return requested_enabled;
+}
+
+/**
+ * @brief PRIVATE Check if an ID is in one of the diagnostic ranges, 0x7DF / 0x7E0-0x7EF for 11 bit
+ * and 0x18DA / 0x18DB (normal fixed addressing) for 29 bit
+ *
+ * @param message
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR static bool is_diagnostic_id(const twai_message_t* message) {
+    if(message->extd)
+        return (message->identifier & 0x1FFE0000) == 0x18DA0000;
+
+    return message->identifier == 0x7DF || (message->identifier & 0x7F0) == 0x7E0;
+}
+
+/**
+ * @brief Get the other end of an ISO 15765-4 ID pair, 0x7E0+n <-> 0x7E8+n for 11 bit and
+ * 0x18DAxxyy <-> 0x18DAyyxx for 29 bit. Functional IDs have no partner.
+ *
+ * @param key CAN ID with the extended flag in the top bit
+ * @return uint32_t partner key with the extended flag kept, 0 if there is none
+ */
+HOT_PATH_ATTR uint32_t isotp_partner_key(uint32_t key) {
+    if(key & ISOTP_EXTENDED_FLAG) {
+        if((key & 0x00FF0000) != 0x00DA0000)
+            return 0;
+
+        return (key & 0xFFFF0000) | ((key & 0xFF) << 8) | ((key >> 8) & 0xFF);
+    }
+
+    if((key & 0x7F0) != 0x7E0)
+        return 0;
+
+    return key ^ 0x08;
+}
+
+/**
+ * @brief PRIVATE Find the session for a sender
+ *
+ * @param key
+ * @return isotp_session_t* NULL if there is none
+ */
+HOT_PATH_ATTR static isotp_session_t* find_session(uint32_t key) {
+    for(size_t i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+        if(sessions[i].used && sessions[i].key == key)
+            return &sessions[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief PRIVATE Open a session with a pooled buffer
+ *
+ * @param key
+ * @return isotp_session_t* NULL if the session table or buffer pool is exhausted
+ */
+HOT_PATH_ATTR static isotp_session_t* open_session(uint32_t key) {
+    isotp_session_t* session = NULL;
+    isotp_buffer_t* buffer = NULL;
+
+    for(size_t i = 0; i < ISOTP_MAX_SESSIONS && session == NULL; i++) {
+        if(!sessions[i].used)
+            session = &sessions[i];
+    }
+
+    for(size_t i = 0; i < ISOTP_POOL_BUFFERS && buffer == NULL; i++) {
+        if(!pool[i].used)
+            buffer = &pool[i];
+    }
+
+    if(session == NULL || buffer == NULL)
+        return NULL;
+
+    memset(session, 0, sizeof(isotp_session_t));
+    session->used = true;
+    session->key = key;
+    session->partner_id = isotp_partner_key(key);
+    session->buffer = buffer;
+    buffer->used = true;
+
+    return session;
+}
+
+/**
+ * @brief PRIVATE Close a session and return its buffer to the pool
+ *
+ * @param session
+ */
+HOT_PATH_ATTR static void close_session(isotp_session_t* session) {
+    if(session->buffer != NULL)
+        session->buffer->used = false;
+
+    session->buffer = NULL;
+    session->used = false;
+}
+
+/**
+ * @brief Feed a received frame to the ISO-TP layer, called by the CAN task for every frame
+ *
+ * Single frames and completed multi-frame sequences are sent as ISOTP_PDU records. First,
+ * consecutive and matched flow control frames are consumed.
+ *
+ * @param message received frame
+ * @param time receive time in microseconds
+ * @return true the frame was consumed and should not be sent as a raw frame
+ * @return false the frame is not ISO-TP and should be sent as is
+ */
+HOT_PATH_ATTR bool isotp_process(const twai_message_t* message, int64_t time) {
+    if(!enabled || message->rtr || message->data_length_code == 0 || !is_diagnostic_id(message))
+        return false;
+
+    uint32_t key = message->identifier | (message->extd ? ISOTP_EXTENDED_FLAG : 0);
+    uint8_t dlc = message->data_length_code > 8 ? 8 : message->data_length_code;
+    const uint8_t* data = message->data;
+    isotp_session_t* session = find_session(key);
+
+    switch(data[0] >> 4) {
+        case ISOTP_PCI_SINGLE: {
+            uint8_t length = data[0] & 0x0F;
+
+            if(length == 0 || length > dlc - 1)
+                return false;
+
+            uint8_t pdu[ISOTP_PDU_HEADER_LEN + 7];
+            isotp_session_t single = { .key = key, .partner_id = isotp_partner_key(key), .start_time = time };
+
+            memcpy(pdu + ISOTP_PDU_HEADER_LEN, data + 1, length);
+            send_pdu(&single, pdu, length, time);
+            return true;
+        }
+
+        case ISOTP_PCI_FIRST: {
+            if(dlc < 8)
+                return false;
+
+            uint16_t length = ((data[0] & 0x0F) << 8) | data[1];
+
+            if(session != NULL) {
+                send_error(key, ISOTP_ERR_INTERRUPTED, session->length, session->received);
+                close_session(session);
+            }
+
+            if(length == 0) {
+                send_error(key, ISOTP_ERR_UNSUPPORTED, 0, 0);
+                return false;
+            }
+
+            // Anything that fits a single frame isn't a valid first frame
+            if(length < 8)
+                return false;
+
+            session = open_session(key);
+
+            if(session == NULL) {
+                send_error(key, ISOTP_ERR_NO_BUFFER, length, 0);
+                return false;
+            }
+
+            session->length = length;
+            session->received = 6;
+            session->next_sequence = 1;
+            session->start_time = time;
+            session->last_time = time;
+            memcpy(session->buffer->data + ISOTP_PDU_HEADER_LEN, data + 2, session->received);
+            return true;
+        }
+
+        case ISOTP_PCI_CONSECUTIVE: {
+            // Without a session this belongs to a sequence we couldn't buffer, pass it through
+            if(session == NULL)
+                return false;
+
+            if((data[0] & 0x0F) != session->next_sequence) {
+                send_error(key, ISOTP_ERR_SEQUENCE, session->length, session->received);
+                close_session(session);
+                return false;
+            }
+
+            uint16_t remaining = session->length - session->received;
+            uint16_t copy_len = remaining < dlc - 1 ? remaining : dlc - 1;
+
+            memcpy(session->buffer->data + ISOTP_PDU_HEADER_LEN + session->received, data + 1, copy_len);
+            session->received += copy_len;
+            session->next_sequence = (session->next_sequence + 1) & 0x0F;
+            session->last_time = time;
+
+            if(session->received == session->length) {
+                send_pdu(session, session->buffer->data, session->length, time);
+                close_session(session);
+            }
+            return true;
+        }
+
+        case ISOTP_PCI_FLOW_CONTROL: {
+            // The flow control belongs to the session sending on the other end of its ID pair
+            uint32_t partner = isotp_partner_key(key);
+            isotp_session_t* flow_session = partner != 0 ? find_session(partner) : NULL;
+
+            if(flow_session == NULL)
+                return false;
+
+            if((data[0] & 0x0F) == ISOTP_FC_OVERFLOW) {
+                send_error(flow_session->key, ISOTP_ERR_ABORTED, flow_session->length, flow_session->received);
+                close_session(flow_session);
+            }
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Apply enable changes and time out stalled sessions, called by the CAN task every loop
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR void isotp_update(int64_t time) {
+    if(requested_enabled != enabled) {
+        for(size_t i = 0; i < ISOTP_MAX_SESSIONS; i++)
+            close_session(&sessions[i]);
+
+        enabled = requested_enabled;
+    }
+
+    if(!enabled)
+        return;
+
+    for(size_t i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+        isotp_session_t* session = &sessions[i];
+
+        if(session->used && time - session->last_time > ISOTP_TIMEOUT_MS * 1000) {
+            send_error(session->key, ISOTP_ERR_TIMEOUT, session->length, session->received);
+            close_session(session);
+        }
+    }
+}
+
+/**
+ * @brief PRIVATE Send an ISOTP_PDU record, the payload must start ISOTP_PDU_HEADER_LEN bytes into
+ * the buffer so the header can be filled in place
+ *
+ * @param session
+ * @param buffer
+ * @param length payload length
+ * @param end_time
+ */
+static void send_pdu(isotp_session_t* session, uint8_t* buffer, uint16_t length, int64_t end_time) {
+    uint32_t header[3] = {
+        htonl(session->partner_id),
+        htonl((uint32_t)session->start_time),
+        htonl((uint32_t)end_time)
+    };
+
+    memcpy(buffer, header, ISOTP_PDU_HEADER_LEN);
+
+    can_bus_send_record(ISOTP_PDU, session->key & ~ISOTP_EXTENDED_FLAG, buffer, ISOTP_PDU_HEADER_LEN + length);
+}
+
+/**
+ * @brief PRIVATE Send an ISOTP_ERROR record
+ *
+ * Data: error (1), announced length (2), received length (2)
+ *
+ * @param key
+ * @param error
+ * @param length
+ * @param received
+ */
+static void send_error(uint32_t key, isotp_error_t error, uint16_t length, uint16_t received) {
+    uint8_t data[5];
+    uint16_t net_length = htons(length);
+    uint16_t net_received = htons(received);
+
+    data[0] = (uint8_t)error;
+    memcpy(data + 1, &net_length, sizeof(uint16_t));
+    memcpy(data + 3, &net_received, sizeof(uint16_t));
+
+    can_bus_send_record(ISOTP_ERROR, key & ~ISOTP_EXTENDED_FLAG, data, sizeof(data));
+}
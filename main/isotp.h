@@ -0,0 +1,31 @@
+#ifndef _ISOTP_H_
+#define _ISOTP_H_
+
+#include "defines.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <driver/twai.h>
+
+// Set in keys and partner IDs for 29 bit identifiers
+#define ISOTP_EXTENDED_FLAG 0x80000000
+
+typedef enum isotp_error_t {
+    ISOTP_ERR_SEQUENCE = 1,     // Consecutive frame out of sequence
+    ISOTP_ERR_TIMEOUT = 2,      // No consecutive frame within ISOTP_TIMEOUT_MS
+    ISOTP_ERR_INTERRUPTED = 3,  // New first frame before the previous PDU completed
+    ISOTP_ERR_NO_BUFFER = 4,    // Session table or buffer pool exhausted
+    ISOTP_ERR_ABORTED = 5,      // Receiver answered with a flow control overflow
+    ISOTP_ERR_UNSUPPORTED = 6   // PDU longer than 4095 bytes
+} isotp_error_t;
+
+void isotp_set_enabled(bool enabled); 
+bool isotp_is_enabled(); 
+
+uint32_t isotp_partner_key(uint32_t key); 
+
+bool isotp_process(const twai_message_t* message, int64_t time); 
+void isotp_update(int64_t time); 
+
+#endif
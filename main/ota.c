@@ -15,6 +15,7 @@ esp_ota_handle_t ota_handle;
 static esp_err_t last_err; 
 
 bool initialized = false; 
+static bool running_update = false; 
 
 /**
  * @brief Initialize everything to do the update
@@ -119,12 +120,23 @@ esp_err_t ota_do_after_update() {
     if(img_state == ESP_OTA_IMG_PENDING_VERIFY)
         last_err = esp_ota_mark_app_valid_cancel_rollback(); 
 
-    printf("RUNNING ON OTA!!!!");
+    // Reported to the host with CONTROL_READY
+    running_update = true; 
 
     return last_err; 
 }
 
 
+/**
+ * @brief Check if the running image came from an OTA update rather than the factory partition
+ * 
+ * @return true 
+ * @return false 
+ */
+bool ota_is_running_update() { 
+    return running_update; 
+}
+
 /**
  * @brief Get the last error as a string
  * TODO(Demi): Finish implementing this function
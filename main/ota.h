@@ -2,11 +2,13 @@
 #define _OTA_H_
 
 #include "esp_check.h"
+#include <stdbool.h>
 
 esp_err_t ota_init(); 
 esp_err_t ota_do_update(void* image, size_t img_size); 
 void ota_cleanup(); 
 esp_err_t ota_do_after_update(); 
+bool ota_is_running_update(); 
 
 esp_err_t ota_get_last_err(); 
 const char* ota_get_last_err_str(); 
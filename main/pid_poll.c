@@ -0,0 +1,367 @@
+#include "pid_poll.h"
+#include "can_bus.h"
+#include "isotp.h"
+#include <string.h>
+#include <lwip/sockets.h>
+
+#define PID_POLL_NEGATIVE_RESPONSE 0x7F
+#define PID_POLL_RESPONSE_PENDING 0x78
+#define PID_POLL_POSITIVE_OFFSET 0x40
+
+typedef struct pid_poll_entry_t {
+    pid_poll_request_t request;
+    int64_t next_due;
+
+    // In flight state
+    bool in_flight;
+    bool receiving;             // First frame seen, waiting on consecutive frames
+    int64_t sent_time;
+    int64_t deadline;
+    uint16_t response_len;
+    uint16_t received;
+    uint8_t next_sequence;
+    uint8_t response[PID_POLL_MAX_RESPONSE_LEN];
+} pid_poll_entry_t;
+
+/// Private variables
+static pid_poll_entry_t entries[PID_POLL_MAX_ENTRIES];
+static size_t entry_count = 0;
+
+// Uploaded by the host command task, applied by the CAN task in pid_poll_update
+static portMUX_TYPE pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static pid_poll_request_t pending_requests[PID_POLL_MAX_ENTRIES];
+static size_t pending_count = 0;
+static volatile bool pending_update = false;
+static volatile bool active = false;
+
+/// Private function pre declarations
+static void send_result(pid_poll_entry_t* entry, pid_poll_status_t status, const uint8_t* payload, size_t payload_len, int64_t time);
+
+/**
+ * @brief Replace the polling list, it is applied by the CAN task on its next update.
+ * An empty list stops polling.
+ *
+ * @param requests
+ * @param count
+ * @return esp_err_t ESP_ERR_INVALID_SIZE if there are more than PID_POLL_MAX_ENTRIES requests
+ */
+esp_err_t pid_poll_set_list(const pid_poll_request_t* requests, size_t count) {
+    if(count > PID_POLL_MAX_ENTRIES)
+        return ESP_ERR_INVALID_SIZE;
+
+    portENTER_CRITICAL(&pending_lock);
+    memcpy(pending_requests, requests, sizeof(pid_poll_request_t) * count);
+    pending_count = count;
+    pending_update = true;
+    portEXIT_CRITICAL(&pending_lock);
+
+    active = count > 0;
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Check if there is a polling list loaded
+ *
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR bool pid_poll_is_active() {
+    return active;
+}
+
+/**
+ * @brief PRIVATE Number of bytes the PID takes in requests and responses
+ *
+ * @param service
+ * @return uint8_t
+ */
+HOT_PATH_ATTR static uint8_t pid_len(uint8_t service) {
+    return service == 0x22 ? 2 : 1;
+}
+
+/**
+ * @brief PRIVATE Check if a positive response echoes the service and PID of the request
+ *
+ * @param entry
+ * @param data response starting at the service byte
+ * @param len
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR static bool matches_request(const pid_poll_entry_t* entry, const uint8_t* data, size_t len) {
+    uint8_t id_len = pid_len(entry->request.service);
+
+    if(len < 1 + id_len || data[0] != entry->request.service + PID_POLL_POSITIVE_OFFSET)
+        return false;
+
+    if(id_len == 2)
+        return ((data[1] << 8) | data[2]) == entry->request.pid;
+
+    return data[1] == (entry->request.pid & 0xFF);
+}
+
+/**
+ * @brief PRIVATE Transmit a frame padded to 8 bytes
+ *
+ * @param id
+ * @param data
+ * @param len
+ * @return esp_err_t
+ */
+static esp_err_t transmit_padded(uint32_t id, const uint8_t* data, size_t len) {
+    twai_message_t message = {
+        .extd = id > 0x7FF,
+        .identifier = id,
+        .data_length_code = 8
+    };
+
+    memset(message.data, PID_POLL_PADDING, sizeof(message.data));
+    memcpy(message.data, data, len);
+
+    return twai_transmit(&message, 0);
+}
+
+/**
+ * @brief PRIVATE ID the flow control for a multi-frame response goes to. Physical requests use
+ * the request ID, whatever the pairing. A functional request (0x7DF / 0x18DB) can't take a flow
+ * control, so the responding ECU's physical ID is derived from its response ID instead.
+ *
+ * @param entry
+ * @return uint32_t
+ */
+static uint32_t flow_control_id(const pid_poll_entry_t* entry) {
+    uint32_t request_id = entry->request.request_id;
+    uint32_t response_id = entry->request.response_id;
+    bool functional = request_id == 0x7DF || (request_id > 0x7FF && (request_id & 0x1FFF0000) == 0x18DB0000);
+
+    if(!functional)
+        return request_id;
+
+    uint32_t partner = isotp_partner_key(response_id | (response_id > 0x7FF ? ISOTP_EXTENDED_FLAG : 0));
+
+    return partner != 0 ? partner & ~ISOTP_EXTENDED_FLAG : request_id;
+}
+
+/**
+ * @brief Match a received frame against the requests in flight, called by the CAN task for
+ * every frame
+ *
+ * @param message received frame
+ * @param time receive time in microseconds
+ * @return true the frame was a response and should not be sent as a raw frame
+ * @return false
+ */
+HOT_PATH_ATTR bool pid_poll_process(const twai_message_t* message, int64_t time) {
+    if(entry_count == 0 || message->rtr || message->data_length_code < 2)
+        return false;
+
+    uint8_t dlc = message->data_length_code > 8 ? 8 : message->data_length_code;
+    const uint8_t* data = message->data;
+
+    for(size_t i = 0; i < entry_count; i++) {
+        pid_poll_entry_t* entry = &entries[i];
+
+        if(!entry->in_flight || entry->request.response_id != message->identifier)
+            continue;
+
+        switch(data[0] >> 4) {
+            case 0x0: { // Single frame
+                uint8_t len = data[0] & 0x0F;
+
+                if(len == 0 || len > dlc - 1)
+                    return false;
+
+                if(len >= 3 && data[1] == PID_POLL_NEGATIVE_RESPONSE && data[2] == entry->request.service) {
+                    if(data[3] == PID_POLL_RESPONSE_PENDING) {
+                        entry->deadline = time + PID_POLL_PENDING_TIMEOUT_MS * 1000;
+                        return true;
+                    }
+
+                    send_result(entry, PID_POLL_NEGATIVE, data + 3, 1, time);
+                    return true;
+                }
+
+                if(!matches_request(entry, data + 1, len))
+                    continue;
+
+                uint8_t header_len = 1 + pid_len(entry->request.service);
+                send_result(entry, PID_POLL_OK, data + 1 + header_len, len - header_len, time);
+                return true;
+            }
+
+            case 0x1: { // First frame, ask for the rest with no block size or separation time
+                uint16_t len = ((data[0] & 0x0F) << 8) | data[1];
+
+                // Anything that fits a single frame isn't a valid first frame
+                if(dlc < 8 || len < 8 || entry->receiving || !matches_request(entry, data + 2, 6))
+                    continue;
+
+                if(len > PID_POLL_MAX_RESPONSE_LEN) {
+                    send_result(entry, PID_POLL_TOO_LONG, NULL, 0, time);
+                    return true;
+                }
+
+                const uint8_t flow_control[] = { 0x30, 0x00, 0x00 };
+                transmit_padded(flow_control_id(entry), flow_control, sizeof(flow_control));
+
+                memcpy(entry->response, data + 2, 6);
+                entry->response_len = len;
+                entry->received = 6;
+                entry->next_sequence = 1;
+                entry->receiving = true;
+                entry->deadline = time + PID_POLL_TIMEOUT_MS * 1000;
+                return true;
+            }
+
+            case 0x2: { // Consecutive frame
+                if(!entry->receiving)
+                    continue;
+
+                if((data[0] & 0x0F) != entry->next_sequence) {
+                    // Let it time out, the raw frame still goes to the host
+                    entry->receiving = false;
+                    return false;
+                }
+
+                uint16_t remaining = entry->response_len - entry->received;
+                uint16_t copy_len = remaining < dlc - 1 ? remaining : dlc - 1;
+
+                // Never write past the response buffer, whatever the first frame announced
+                if(copy_len > sizeof(entry->response) - entry->received)
+                    copy_len = sizeof(entry->response) - entry->received;
+
+                memcpy(entry->response + entry->received, data + 1, copy_len);
+                entry->received += copy_len;
+                entry->next_sequence = (entry->next_sequence + 1) & 0x0F;
+                entry->deadline = time + PID_POLL_TIMEOUT_MS * 1000;
+
+                if(entry->received == entry->response_len) {
+                    uint8_t header_len = 1 + pid_len(entry->request.service);
+                    send_result(entry, PID_POLL_OK, entry->response + header_len, entry->response_len - header_len, time);
+                }
+                return true;
+            }
+
+            default:
+                continue;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief PRIVATE Check if a request to the same ECU is already in flight
+ *
+ * @param response_id
+ * @return true
+ * @return false
+ */
+HOT_PATH_ATTR static bool ecu_busy(uint32_t response_id) {
+    for(size_t i = 0; i < entry_count; i++) {
+        if(entries[i].in_flight && entries[i].request.response_id == response_id)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Apply a new polling list, time out requests and issue every request that is due.
+ * Called by the CAN task every loop.
+ *
+ * @param time current time in microseconds
+ */
+HOT_PATH_ATTR void pid_poll_update(int64_t time) {
+    if(pending_update) {
+        portENTER_CRITICAL(&pending_lock);
+        memset(entries, 0, sizeof(entries));
+        for(size_t i = 0; i < pending_count; i++) {
+            entries[i].request = pending_requests[i];
+            entries[i].next_due = time;
+        }
+        entry_count = pending_count;
+        pending_update = false;
+        portEXIT_CRITICAL(&pending_lock);
+    }
+
+    for(size_t i = 0; i < entry_count; i++) {
+        pid_poll_entry_t* entry = &entries[i];
+
+        if(entry->in_flight && time > entry->deadline)
+            send_result(entry, PID_POLL_TIMEOUT, NULL, 0, time);
+    }
+
+    // Issue the most overdue request for every idle ECU, responses to different ECUs overlap
+    for(;;) {
+        pid_poll_entry_t* next = NULL;
+
+        for(size_t i = 0; i < entry_count; i++) {
+            pid_poll_entry_t* entry = &entries[i];
+
+            if(entry->in_flight || entry->next_due > time || ecu_busy(entry->request.response_id))
+                continue;
+
+            if(next == NULL || entry->next_due < next->next_due)
+                next = entry;
+        }
+
+        if(next == NULL)
+            return;
+
+        uint8_t request[4];
+        uint8_t len = 0;
+
+        request[len++] = 1 + pid_len(next->request.service);
+        request[len++] = next->request.service;
+        if(pid_len(next->request.service) == 2)
+            request[len++] = next->request.pid >> 8;
+        request[len++] = next->request.pid & 0xFF;
+
+        // TX queue full, try again on the next update
+        if(transmit_padded(next->request.request_id, request, len) != ESP_OK)
+            return;
+
+        next->in_flight = true;
+        next->receiving = false;
+        next->sent_time = time;
+        next->deadline = time + PID_POLL_TIMEOUT_MS * 1000;
+
+        // Keep the schedule on its grid unless we fell behind by more than a period
+        int64_t period_us = (int64_t)next->request.period_ms * 1000;
+        next->next_due = next->next_due + period_us > time ? next->next_due + period_us : time + period_us;
+    }
+}
+
+/**
+ * @brief PRIVATE Send a PID_RESULT record and free the request slot
+ *
+ * Data: status (1), service (1), pid (2), latency in microseconds (4), payload
+ *
+ * @param entry
+ * @param status
+ * @param payload
+ * @param payload_len
+ * @param time
+ */
+static void send_result(pid_poll_entry_t* entry, pid_poll_status_t status, const uint8_t* payload, size_t payload_len, int64_t time) {
+    uint8_t data[8 + PID_POLL_MAX_RESPONSE_LEN];
+    uint16_t net_pid = htons(entry->request.pid);
+    uint32_t net_latency = htonl((uint32_t)(time - entry->sent_time));
+
+    if(payload_len > PID_POLL_MAX_RESPONSE_LEN)
+        payload_len = PID_POLL_MAX_RESPONSE_LEN;
+
+    data[0] = (uint8_t)status;
+    data[1] = entry->request.service;
+    memcpy(data + 2, &net_pid, sizeof(uint16_t));
+    memcpy(data + 4, &net_latency, sizeof(uint32_t));
+    if(payload_len > 0)
+        memcpy(data + 8, payload, payload_len);
+
+    entry->in_flight = false;
+    entry->receiving = false;
+
+    can_bus_send_record(PID_RESULT, entry->request.response_id, data, 8 + payload_len);
+}
@@ -0,0 +1,34 @@
+#ifndef _PID_POLL_H_
+#define _PID_POLL_H_
+
+#include "defines.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include <driver/twai.h>
+
+#define PID_POLL_UPLOAD_ENTRY_LEN 13 // Bytes per request in the 'l' command
+
+typedef enum pid_poll_status_t {
+    PID_POLL_OK = 0,
+    PID_POLL_TIMEOUT = 1,       // No response within PID_POLL_TIMEOUT_MS
+    PID_POLL_NEGATIVE = 2,      // Negative response, the payload is the NRC
+    PID_POLL_TOO_LONG = 3       // Response longer than PID_POLL_MAX_RESPONSE_LEN
+} pid_poll_status_t;
+
+typedef struct pid_poll_request_t {
+    uint8_t service;            // 0x01 / 0x02 for OBD-II, 0x22 for UDS ReadDataByIdentifier
+    uint16_t pid;               // One byte for OBD-II services, two bytes (DID) for 0x22
+    uint32_t request_id;
+    uint32_t response_id;
+    uint16_t period_ms;         // 0 polls as fast as the ECU answers
+} pid_poll_request_t;
+
+esp_err_t pid_poll_set_list(const pid_poll_request_t* requests, size_t count); 
+bool pid_poll_is_active(); 
+
+bool pid_poll_process(const twai_message_t* message, int64_t time); 
+void pid_poll_update(int64_t time); 
+
+#endif
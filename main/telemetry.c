@@ -0,0 +1,62 @@
+#include "telemetry.h"
+#include "can_bus.h"
+#include "comms.h"
+#include "backpressure.h"
+#include <string.h>
+#include <esp_heap_caps.h>
+
+/// Private variables
+static TaskHandle_t task_handles[TELEMETRY_MAX_TASKS]; 
+static size_t task_count = 0; 
+
+/**
+ * @brief Register a task to have its stack high water mark reported
+ * 
+ * @param handle 
+ * @return esp_err_t ESP_ERR_NO_MEM if TELEMETRY_MAX_TASKS are already registered
+ */
+esp_err_t telemetry_register_task(TaskHandle_t handle) { 
+    if(handle == NULL)
+        return ESP_ERR_INVALID_ARG; 
+
+    if(task_count == TELEMETRY_MAX_TASKS)
+        return ESP_ERR_NO_MEM; 
+
+    task_handles[task_count++] = handle; 
+
+    return ESP_OK; 
+}
+
+/**
+ * @brief Send a TELEMETRY record with the current memory usage
+ * 
+ * Data: free heap (4), minimum free heap (4), largest free block (4), total drops (4), 
+ * queue fill percent (1), task count (1), then per task: stack high water mark in bytes (4), 
+ * name length (1), name
+ * 
+ * @return esp_err_t 
+ */
+esp_err_t telemetry_send() { 
+    uint8_t data[4 * sizeof(uint32_t) + 2 + TELEMETRY_MAX_TASKS * (sizeof(uint32_t) + 1 + configMAX_TASK_NAME_LEN)]; 
+    size_t len = 0; 
+
+    len += comms_put_u32(data + len, heap_caps_get_free_size(MALLOC_CAP_8BIT)); 
+    len += comms_put_u32(data + len, heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT)); 
+    len += comms_put_u32(data + len, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)); 
+    len += comms_put_u32(data + len, backpressure_get_drop_count()); 
+    data[len++] = comms_queue_fill(); 
+    data[len++] = (uint8_t)task_count; 
+
+    for(size_t i = 0; i < task_count; i++) { 
+        const char* name = pcTaskGetName(task_handles[i]); 
+        size_t name_len = strnlen(name, configMAX_TASK_NAME_LEN); 
+
+        // ESP-IDF stack sizes and high water marks are in bytes
+        len += comms_put_u32(data + len, uxTaskGetStackHighWaterMark(task_handles[i])); 
+        data[len++] = (uint8_t)name_len; 
+        memcpy(data + len, name, name_len); 
+        len += name_len; 
+    }
+
+    return can_bus_send_record(TELEMETRY, 0, data, len); 
+}
@@ -0,0 +1,15 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include "defines.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_err.h>
+
+#define TELEMETRY_MAX_TASKS 8
+
+esp_err_t telemetry_register_task(TaskHandle_t handle); 
+esp_err_t telemetry_send(); 
+
+#endif